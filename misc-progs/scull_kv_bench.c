@@ -0,0 +1,235 @@
+//
+// Keyed record lookups on a scull device: userspace hashing over
+// pread/pwrite against the in-kernel index (SCULL_IOCKV*).
+//
+// usage: scull_kv_bench [device] [records] [value size]
+//
+// The userspace layout is an open-addressed slot table at offset 0
+// followed by records (struct scull_kv_hdr, key, value), so a lookup
+// costs one pread per probed slot plus one for the key and one for the
+// value. The device is trimmed before each run.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "../scull/scull.h"
+
+struct slot {
+    uint64_t hash; /* 0: empty */
+    uint64_t off;  /* record position */
+};
+
+static long syscalls;
+static char *value;
+static char *readback;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t fnv1a(const char *s, size_t n)
+{
+    uint64_t h = 1469598103934665603ULL;
+    while (n--) {
+        h ^= (unsigned char) *s++;
+        h *= 1099511628211ULL;
+    }
+    return h | 1;
+}
+
+/* scull moves at most one quantum per call */
+static int pio(int fd, void *buf, size_t count, off_t off, int write)
+{
+    ssize_t n;
+    while (count) {
+        n = write ? pwrite(fd, buf, count, off) : pread(fd, buf, count, off);
+        syscalls++;
+        if (n <= 0)
+            return -1;
+        buf = (char *) buf + n;
+        count -= (size_t) n;
+        off += n;
+    }
+    return 0;
+}
+
+static int reopen(const char *path)
+{
+    int fd = open(path, O_WRONLY); /* trims the device */
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void report(const char *what, long ops, double elapsed)
+{
+    printf("%-22s %10.0f ops/s %6.2f syscalls/op\n", what,
+           (double) ops / elapsed, (double) syscalls / (double) ops);
+    syscalls = 0;
+}
+
+static void bench_user(const char *path, long records, size_t vlen)
+{
+    struct scull_kv_hdr hdr;
+    struct slot s, *table;
+    char key[32];
+    uint64_t nslots = 1, mask, i, h;
+    off_t end;
+    double start;
+    long r, found = 0;
+    int fd = reopen(path);
+
+    while (nslots < 2 * (uint64_t) records)
+        nslots <<= 1;
+    mask = nslots - 1;
+    end = (off_t) (nslots * sizeof(struct slot));
+    /* an empty table, scull returns nothing for holes */
+    table = calloc(nslots, sizeof(struct slot));
+    if (!table || pio(fd, table, (size_t) end, 0, 1))
+        goto fail;
+    free(table);
+    syscalls = 0;
+
+    start = now();
+    for (r = 0; r < records; r++) {
+        hdr.key_len = (uint32_t) sprintf(key, "key%08ld", r);
+        hdr.value_len = (uint32_t) vlen;
+        h = fnv1a(key, hdr.key_len);
+        for (i = h & mask;; i = (i + 1) & mask) {
+            if (pio(fd, &s, sizeof(s), (off_t) (i * sizeof(s)), 0))
+                goto fail;
+            if (!s.hash)
+                break;
+        }
+        if (pio(fd, &hdr, sizeof(hdr), end, 1) ||
+            pio(fd, key, hdr.key_len, end + (off_t) sizeof(hdr), 1) ||
+            pio(fd, value, vlen, end + (off_t) (sizeof(hdr) + hdr.key_len), 1))
+            goto fail;
+        s.hash = h;
+        s.off = (uint64_t) end;
+        if (pio(fd, &s, sizeof(s), (off_t) (i * sizeof(s)), 1))
+            goto fail;
+        end += (off_t) (sizeof(hdr) + hdr.key_len + vlen);
+    }
+    report("userspace put", records, now() - start);
+
+    start = now();
+    for (r = 0; r < records; r++) {
+        char rkey[sizeof(hdr) + sizeof(key)];
+        size_t klen = (size_t) sprintf(key, "key%08ld", r);
+        h = fnv1a(key, klen);
+        for (i = h & mask;; i = (i + 1) & mask) {
+            if (pio(fd, &s, sizeof(s), (off_t) (i * sizeof(s)), 0))
+                goto fail;
+            if (!s.hash)
+                break;
+            if (s.hash != h)
+                continue;
+            if (pio(fd, rkey, sizeof(hdr) + klen, (off_t) s.off, 0))
+                goto fail;
+            memcpy(&hdr, rkey, sizeof(hdr));
+            if (hdr.key_len != klen || memcmp(rkey + sizeof(hdr), key, klen))
+                continue;
+            if (pio(fd, readback, hdr.value_len, (off_t) (s.off + sizeof(hdr) + klen), 0))
+                goto fail;
+            found++;
+            break;
+        }
+    }
+    report("userspace get", records, now() - start);
+    if (found != records)
+        fprintf(stderr, "userspace: %ld of %ld records found\n", found, records);
+    close(fd);
+    return;
+    fail:
+        perror("userspace");
+        exit(1);
+}
+
+static void bench_ioctl(const char *path, long records, size_t vlen)
+{
+    struct scull_kv_req req;
+    char key[32];
+    double start;
+    long r;
+    int fd = reopen(path);
+
+    if (ioctl(fd, SCULL_IOCTKV, 1) < 0) {
+        perror("SCULL_IOCTKV");
+        exit(1);
+    }
+    req.key = (uintptr_t) key;
+    start = now();
+    for (r = 0; r < records; r++) {
+        req.key_len = (uint32_t) sprintf(key, "key%08ld", r);
+        req.value = (uintptr_t) value;
+        req.value_len = (uint32_t) vlen;
+        syscalls++;
+        if (ioctl(fd, SCULL_IOCKVPUT, &req) < 0)
+            goto fail;
+    }
+    report("ioctl put", records, now() - start);
+
+    start = now();
+    for (r = 0; r < records; r++) {
+        req.key_len = (uint32_t) sprintf(key, "key%08ld", r);
+        req.value = (uintptr_t) readback;
+        req.value_len = (uint32_t) vlen;
+        syscalls++;
+        if (ioctl(fd, SCULL_IOCKVGET, &req) < 0)
+            goto fail;
+    }
+    report("ioctl get", records, now() - start);
+    ioctl(fd, SCULL_IOCTKV, 0);
+    close(fd);
+    return;
+    fail:
+        perror("ioctl");
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/scull0";
+    long records = 10000;
+    size_t vlen = 100;
+
+    if (argc > 1)
+        path = argv[1];
+    if (argc > 2)
+        records = atol(argv[2]);
+    if (argc > 3)
+        vlen = (size_t) atol(argv[3]);
+    if (records <= 0 || vlen > SCULL_KV_MAX_VALUE) {
+        fprintf(stderr, "usage: %s [device] [records] [value size]\n", argv[0]);
+        exit(1);
+    }
+    value = malloc(vlen + 1);
+    readback = malloc(vlen + 1);
+    if (!value || !readback)
+        exit(1);
+    memset(value, 'v', vlen);
+
+    bench_user(path, records, vlen);
+    bench_ioctl(path, records, vlen);
+    close(reopen(path));
+    return 0;
+}
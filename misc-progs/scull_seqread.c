@@ -0,0 +1,118 @@
+//
+// Sequential read bandwidth of a scull device, byte quanta vs large quanta.
+//
+// usage: scull_seqread [device] [megabytes] [order] [passes]
+//
+// The device is filled once per layout and then read from start to end
+// "passes" times with a 4 MiB buffer. Switching layouts needs
+// CAP_SYS_ADMIN (SCULL_IOCTLARGE).
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "../scull/scull.h"
+
+#define BUFSIZE (4 << 20)
+
+static char buffer[BUFSIZE];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* trim the device, switch its layout and fill it with size bytes */
+static int fill(const char *path, int order, long size)
+{
+    long done = 0;
+    ssize_t n;
+    int fd = open(path, O_WRONLY);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (ioctl(fd, SCULL_IOCTLARGE, order) < 0) {
+        perror("SCULL_IOCTLARGE");
+        close(fd);
+        return -1;
+    }
+    memset(buffer, 'x', sizeof(buffer));
+    while (done < size) {
+        n = write(fd, buffer, size - done < BUFSIZE ? size - done : BUFSIZE);
+        if (n < 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static int run(const char *path, int order, long size, int passes)
+{
+    long total = 0, calls = 0;
+    double start, elapsed;
+    ssize_t n;
+    int fd, i;
+
+    if (fill(path, order, size))
+        return -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    start = now();
+    for (i = 0; i < passes; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, buffer, BUFSIZE)) > 0) {
+            total += n;
+            calls++;
+        }
+        if (n < 0) {
+            perror("read");
+            close(fd);
+            return -1;
+        }
+    }
+    elapsed = now() - start;
+    close(fd);
+    printf("%-14s order %2d: %8.1f MB/s, %ld reads, %.0f bytes/read\n",
+           order ? "large quanta" : "byte quanta", order,
+           (double) total / elapsed / 1e6, calls,
+           calls ? (double) total / (double) calls : 0.0);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/scull0";
+    long size = 256L << 20;
+    int order = 9, passes = 8;
+
+    if (argc > 1)
+        path = argv[1];
+    if (argc > 2)
+        size = atol(argv[2]) << 20;
+    if (argc > 3)
+        order = atoi(argv[3]);
+    if (argc > 4)
+        passes = atoi(argv[4]);
+
+    if (run(path, 0, size, passes) || run(path, order, size, passes))
+        exit(1);
+    /* leave the device in its default layout */
+    fill(path, 0, 0);
+    return 0;
+}
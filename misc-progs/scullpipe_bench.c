@@ -0,0 +1,455 @@
+//
+// Round-trip latency and streaming throughput of scullpipe, with a
+// native pipe as the baseline.
+//
+// usage: scullpipe_bench [-d device] [-p peer] [-t tests] [-w waits]
+//                        [-s sizes] [-b buffer sizes] [-m megabytes] [-n round trips]
+//
+// tests: pingpong,stream (default both)
+// waits: block,nonblock,poll,epoll,sigio (default all)
+// sizes and buffer sizes are comma separated byte counts.
+//
+// Ping-pong bounces a message between two processes, out through the
+// device and back through the peer, and reports the round trip. Stream
+// sends megabytes from a child to its parent in writes and reads of
+// one message size, for each ring size (SCULL_P_IOCTBUF, F_SETPIPE_SZ),
+// and reports the bandwidth, reads per megabyte and how often each side
+// had to wait. In all waits but block both ends are O_NONBLOCK and wait
+// out EAGAIN by spinning on sched_yield(), in poll(), in epoll_wait()
+// or for SIGIO. scullpipe only signals readers, so sigio writers wait
+// in poll().
+//
+
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../scull/scull.h"
+
+enum { W_BLOCK, W_NONBLOCK, W_POLL, W_EPOLL, W_SIGIO, W_NR };
+static const char *wait_names[W_NR] = { "block", "nonblock", "poll", "epoll", "sigio" };
+static const char *test_names[2] = { "pingpong", "stream" };
+
+#define MAX_SIZES 16
+
+/* one end of a pipe, and how it waits */
+struct end {
+    int fd;
+    int ep;     /* epoll instance in W_EPOLL */
+    short ev;   /* POLLIN to read, POLLOUT to write */
+    int wait;
+    long calls; /* read()s or write()s */
+    long waits; /* EAGAINs waited out */
+};
+
+/* both ends of one pipe */
+struct chan {
+    int rfd, wfd;
+    int native;
+    long saved; /* scullpipe ring size to put back, 0: untouched */
+};
+
+static sigset_t sigio_set;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int end_setup(struct end *e, int fd, short ev, int wait)
+{
+    struct epoll_event ee;
+
+    e->fd = fd;
+    e->ep = -1;
+    e->ev = ev;
+    e->wait = wait;
+    e->calls = e->waits = 0;
+    if (wait == W_BLOCK)
+        return 0;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+    if (wait == W_EPOLL) {
+        memset(&ee, 0, sizeof(ee));
+        ee.events = ev == POLLIN ? EPOLLIN : EPOLLOUT;
+        ee.data.fd = fd;
+        e->ep = epoll_create1(0);
+        if (e->ep < 0 || epoll_ctl(e->ep, EPOLL_CTL_ADD, fd, &ee) < 0)
+            return -1;
+    }
+    /* SIGIO stays blocked, sigwaitinfo() takes it */
+    if (wait == W_SIGIO && ev == POLLIN &&
+        (fcntl(fd, F_SETOWN, getpid()) < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) < 0))
+        return -1;
+    return 0;
+}
+
+static void end_close(struct end *e)
+{
+    if (e->ep >= 0)
+        close(e->ep);
+    close(e->fd);
+}
+
+/* wait for the end to be ready again after an EAGAIN */
+static int end_wait(struct end *e)
+{
+    struct epoll_event ee;
+    struct pollfd p;
+
+    e->waits++;
+    switch (e->wait) {
+    case W_NONBLOCK:
+        /* spin, but let the other end run on a single CPU */
+        return sched_yield();
+    case W_EPOLL:
+        return epoll_wait(e->ep, &ee, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+    case W_SIGIO:
+        if (e->ev == POLLIN)
+            return sigwaitinfo(&sigio_set, NULL) < 0 && errno != EINTR ? -1 : 0;
+        /* writers get no SIGIO from scullpipe */
+        /* fall through */
+    case W_POLL:
+    default:
+        p.fd = e->fd;
+        p.events = e->ev;
+        p.revents = 0;
+        return poll(&p, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+    }
+}
+
+/* one read() or write() that moves something, waiting out EAGAIN */
+static ssize_t end_io(struct end *e, char *buf, size_t len)
+{
+    ssize_t n;
+
+    for (;;) {
+        n = e->ev == POLLIN ? read(e->fd, buf, len) : write(e->fd, buf, len);
+        e->calls++;
+        if (n >= 0 || errno != EAGAIN)
+            return n;
+        if (end_wait(e) < 0)
+            return -1;
+    }
+}
+
+/* move exactly len bytes */
+static int end_full(struct end *e, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = end_io(e, buf, len);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int chan_open(struct chan *c, const char *path, int native, size_t bufsize)
+{
+    int fds[2];
+
+    c->native = native;
+    c->saved = 0;
+    c->rfd = c->wfd = -1; /* for chan_close() whatever fails */
+    if (native) {
+        if (pipe(fds) < 0)
+            return -1;
+        c->rfd = fds[0];
+        c->wfd = fds[1];
+        return bufsize && fcntl(c->wfd, F_SETPIPE_SZ, (int) bufsize) < 0 ? -1 : 0;
+    }
+    /* open both ends first so neither open resets data in flight */
+    c->rfd = open(path, O_RDONLY);
+    c->wfd = open(path, O_WRONLY);
+    if (c->rfd < 0 || c->wfd < 0)
+        return -1;
+    if (!bufsize)
+        return 0;
+    c->saved = ioctl(c->wfd, SCULL_P_IOCQBUF);
+    return c->saved < 0 || ioctl(c->wfd, SCULL_P_IOCTBUF, bufsize) < 0 ? -1 : 0;
+}
+
+static void chan_close(struct chan *c)
+{
+    if (c->rfd >= 0)
+        close(c->rfd);
+    if (c->wfd >= 0)
+        close(c->wfd);
+}
+
+/* put the ring size back, it sticks to the device */
+static void chan_restore(struct chan *c, int fd)
+{
+    if (c->saved > 0)
+        ioctl(fd, SCULL_P_IOCTBUF, (unsigned long) c->saved);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int pingpong(const char *dev, const char *peer, int native, int wait, size_t size, long rounds)
+{
+    struct chan ab, ba;
+    struct end out, in;
+    double *rtt, start, sum = 0;
+    char *buf;
+    long r;
+    int status, ok;
+    pid_t pid;
+
+    ba.rfd = ba.wfd = -1; /* in case ab fails first */
+    if (chan_open(&ab, dev, native, 0) || chan_open(&ba, peer, native, 0)) {
+        perror(native ? "pipe" : dev);
+        chan_close(&ab);
+        chan_close(&ba);
+        return -1;
+    }
+    buf = malloc(size);
+    rtt = malloc((size_t) rounds * sizeof(double));
+    if (!buf || !rtt) {
+        chan_close(&ab);
+        chan_close(&ba);
+        free(buf);
+        free(rtt);
+        return -1;
+    }
+    memset(buf, 'p', size);
+    fflush(stdout); /* or the child prints it again */
+    pid = fork();
+    if (pid == 0) {
+        /* echo everything from ab back through ba */
+        close(ab.wfd);
+        close(ba.rfd);
+        if (end_setup(&in, ab.rfd, POLLIN, wait) || end_setup(&out, ba.wfd, POLLOUT, wait))
+            exit(1);
+        for (r = 0; r < rounds; r++)
+            if (end_full(&in, buf, size) || end_full(&out, buf, size))
+                exit(1);
+        exit(0);
+    }
+    close(ab.rfd);
+    close(ba.wfd);
+    out.fd = ab.wfd;
+    in.fd = ba.rfd;
+    out.ep = in.ep = -1;
+    ok = pid > 0 && !end_setup(&out, ab.wfd, POLLOUT, wait) && !end_setup(&in, ba.rfd, POLLIN, wait);
+    for (r = 0; ok && r < rounds; r++) {
+        start = now();
+        ok = !end_full(&out, buf, size) && !end_full(&in, buf, size);
+        rtt[r] = (now() - start) * 1e6;
+        sum += rtt[r];
+    }
+    if (pid > 0) {
+        if (!ok)
+            kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        ok = ok && WIFEXITED(status) && !WEXITSTATUS(status);
+    }
+    end_close(&out);
+    end_close(&in);
+    if (ok) {
+        qsort(rtt, (size_t) rounds, sizeof(double), cmp_double);
+        printf("pingpong %-9s %-8s %7zu B:            avg %8.2f us  p50 %8.2f  p99 %8.2f  max %9.2f\n",
+               native ? "pipe" : "scullpipe", wait_names[wait], size, sum / (double) rounds,
+               rtt[rounds / 2], rtt[rounds * 99 / 100], rtt[rounds - 1]);
+    } else {
+        fprintf(stderr, "pingpong %s %s %zu B failed\n", native ? "pipe" : dev, wait_names[wait], size);
+    }
+    free(buf);
+    free(rtt);
+    return ok ? 0 : -1;
+}
+
+static int stream(const char *dev, int native, int wait, size_t size, size_t bufsize, long total)
+{
+    struct chan c;
+    struct end e;
+    long done = 0, counts[2];
+    double start, elapsed, mb = (double) total / (1 << 20);
+    int status, ok, pfd[2];
+    char *buf;
+    ssize_t n;
+    pid_t pid;
+
+    if (chan_open(&c, dev, native, bufsize)) {
+        perror(native ? "pipe" : dev);
+        chan_close(&c);
+        return -1;
+    }
+    buf = malloc(size);
+    if (!buf || pipe(pfd) < 0) {
+        chan_close(&c);
+        free(buf);
+        return -1;
+    }
+    memset(buf, 's', size);
+    start = now();
+    fflush(stdout); /* or the child prints it again */
+    pid = fork();
+    if (pid == 0) {
+        close(c.rfd);
+        close(pfd[0]);
+        if (end_setup(&e, c.wfd, POLLOUT, wait))
+            exit(1);
+        while (done < total) {
+            n = end_io(&e, buf, total - done < (long) size ? (size_t) (total - done) : size);
+            if (n <= 0)
+                exit(1);
+            done += n;
+        }
+        /* hand the counts to the parent */
+        counts[0] = e.calls;
+        counts[1] = e.waits;
+        exit(write(pfd[1], counts, sizeof(counts)) != sizeof(counts));
+    }
+    close(c.wfd);
+    close(pfd[1]);
+    e.fd = c.rfd;
+    e.ep = -1;
+    ok = pid > 0 && !end_setup(&e, c.rfd, POLLIN, wait);
+    while (ok && done < total) {
+        n = end_io(&e, buf, size);
+        ok = n > 0;
+        done += n;
+    }
+    elapsed = now() - start;
+    if (pid > 0) {
+        if (!ok)
+            kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        ok = ok && WIFEXITED(status) && !WEXITSTATUS(status) &&
+             read(pfd[0], counts, sizeof(counts)) == sizeof(counts);
+    }
+    chan_restore(&c, c.rfd);
+    end_close(&e);
+    close(pfd[0]);
+    free(buf);
+    if (!ok) {
+        fprintf(stderr, "stream %s %s %zu B failed\n", native ? "pipe" : dev, wait_names[wait], size);
+        return -1;
+    }
+    printf("stream   %-9s %-8s %7zu B buf %7zu: %8.1f MB/s  reads/MB %8.1f  waits/MB r %8.1f w %8.1f\n",
+           native ? "pipe" : "scullpipe", wait_names[wait], size, bufsize, (double) total / elapsed / 1e6,
+           (double) e.calls / mb, (double) e.waits / mb, (double) counts[1] / mb);
+    return 0;
+}
+
+/* parse "a,b,c" into at most MAX_SIZES sizes */
+static int parse_sizes(const char *arg, size_t *sizes)
+{
+    char *end;
+    int n = 0;
+
+    while (*arg && n < MAX_SIZES) {
+        sizes[n] = (size_t) strtoul(arg, &end, 0);
+        if (end == arg || !sizes[n])
+            return -1;
+        n++;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/* parse "a,b,c" into a mask of names[] indices, 0 for an unknown name */
+static int parse_names(char *arg, const char **names, int n)
+{
+    int mask = 0, i;
+    char *tok;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        for (i = 0; i < n && strcmp(tok, names[i]); i++)
+            ;
+        if (i == n)
+            return 0;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d device] [-p peer] [-t pingpong,stream] [-w %s,%s,%s,%s,%s]\n"
+                    "       [-s sizes] [-b buffer sizes] [-m megabytes] [-n round trips]\n",
+            prog, wait_names[0], wait_names[1], wait_names[2], wait_names[3], wait_names[4]);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev = "/dev/scullpipe0", *peer = "/dev/scullpipe1";
+    size_t sizes[MAX_SIZES] = { 1, 64, 4096, 65536 }, bufs[MAX_SIZES] = { 4096, 65536, 1 << 20 };
+    int nsizes = 4, nbufs = 3, waits = (1 << W_NR) - 1, tests = 3, err = 0;
+    long total = 16L << 20, rounds = 10000;
+    int opt, w, i, j, native;
+
+    while ((opt = getopt(argc, argv, "d:p:t:w:s:b:m:n:")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'p':
+            peer = optarg;
+            break;
+        case 't':
+            tests = parse_names(optarg, test_names, 2);
+            break;
+        case 'w':
+            waits = parse_names(optarg, wait_names, W_NR);
+            break;
+        case 's':
+            nsizes = parse_sizes(optarg, sizes);
+            break;
+        case 'b':
+            nbufs = parse_sizes(optarg, bufs);
+            break;
+        case 'm':
+            total = atol(optarg) << 20;
+            break;
+        case 'n':
+            rounds = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!tests || !waits || nsizes <= 0 || nbufs <= 0 || total <= 0 || rounds <= 0)
+        usage(argv[0]);
+
+    /* SIGIO is only ever taken with sigwaitinfo(), children inherit the mask */
+    sigemptyset(&sigio_set);
+    sigaddset(&sigio_set, SIGIO);
+    sigprocmask(SIG_BLOCK, &sigio_set, NULL);
+
+    for (w = 0; w < W_NR; w++) {
+        if (!(waits & (1 << w)))
+            continue;
+        for (native = 1; native >= 0; native--) {
+            for (i = 0; (tests & 1) && i < nsizes; i++)
+                err |= pingpong(dev, peer, native, w, sizes[i], rounds);
+            for (i = 0; (tests & 2) && i < nsizes; i++)
+                for (j = 0; j < nbufs; j++)
+                    err |= stream(dev, native, w, sizes[i], bufs[j], total);
+        }
+    }
+    return err ? 1 : 0;
+}
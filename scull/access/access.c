@@ -67,7 +67,7 @@ struct file_operations scull_s_fops = {
         .llseek =     	scull_llseek,
         .read =       	scull_read,
         .write =      	scull_write,
-        .unlocked_ioctl = scull_ioctl,
+        .unlocked_ioctl = scull_dev_ioctl,
         .open =       	scull_s_open,
         .release =    	scull_s_release,
 };
@@ -111,7 +111,7 @@ struct file_operations scull_u_fops = {
         .llseek =     	scull_llseek,
         .read =       	scull_read,
         .write =      	scull_write,
-        .unlocked_ioctl = scull_ioctl,
+        .unlocked_ioctl = scull_dev_ioctl,
         .open =       	scull_u_open,
         .release =    	scull_u_release,
 };
@@ -165,7 +165,7 @@ struct file_operations scull_w_fops = {
         .llseek =     	scull_llseek,
         .read =       	scull_read,
         .write =      	scull_write,
-        .unlocked_ioctl = scull_ioctl,
+        .unlocked_ioctl = scull_dev_ioctl,
         .open =       	scull_w_open,
         .release =    	scull_w_release,
 };
@@ -244,7 +244,7 @@ struct file_operations scull_c_fops = {
         .llseek =     	scull_llseek,
         .read =       	scull_read,
         .write =      	scull_write,
-        .unlocked_ioctl = scull_ioctl,
+        .unlocked_ioctl = scull_dev_ioctl,
         .open =       	scull_c_open,
         .release =    	scull_c_release,
 };
@@ -310,11 +310,13 @@ void scull_access_cleanup(void){
         struct scull_dev *dev = scull_access_devs[i].sculldev;
         cdev_del(&dev->cdev);
         scull_trim(dev);
+        scull_kv_destroy(dev);
     }
     /* Clean up all cloned devices - virtual clones */
     list_for_each_entry_safe(lptr, next, &scull_c_list, list){
         list_del(&lptr->list);
         scull_trim(&lptr->device);
+        scull_kv_destroy(&lptr->device);
         kfree(lptr);
 
     }
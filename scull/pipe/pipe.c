@@ -1,9 +1,20 @@
 #include <linux/module.h>
 #include <linux/sched.h>
+#include <linux/sched/task.h>	/* get_task_struct() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>
 #include <linux/fs.h>		/* everything... */
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/wait_bit.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/shrinker.h>
 #include "../scull.h"
 
 
@@ -25,30 +36,712 @@ module_param(scull_quantum, int, 0);
 module_param(scull_qset, int, 0);
 module_param(scull_p_buffer, int, 0);
 
+static int scull_p_shards = 0;	/* sharded mode for every device, see SCULL_P_IOCTSHARDS */
+module_param(scull_p_shards, int, 0);
+
+static unsigned long scull_p_pool_max = 4 << 20;	/* bytes of idle rings kept for reuse, 0: none */
+module_param(scull_p_pool_max, ulong, 0644);
+
+static bool scull_p_handoff = true;	/* writers copy straight into a blocked reader's buffer */
+module_param(scull_p_handoff, bool, 0644);
+
 static struct scull_pipe *scull_devices;
+static struct proc_dir_entry *scull_p_proc, *scull_p_stats_proc;
+
+/*
+ * What an open file keeps of its own: filp->private_data
+ */
+struct scull_p_file {
+    struct scull_pipe *dev;
+    struct scull_p_sub *sub; /* cursor of a broadcast reader */
+    int lane;                /* lane of plain write()s, see SCULL_P_IOCTLANE */
+    u64 lat;                 /* queueing delay of the last stamped read, see SCULL_P_IOCGLAT */
+};
+
+static inline struct scull_p_file *scull_p_file(struct file *filp){
+    return filp->private_data;
+}
+static inline struct scull_pipe *scull_p_dev(struct file *filp){
+    return scull_p_file(filp)->dev;
+}
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
+static int scull_p_sub_add(struct scull_pipe *dev, struct file *filp);
+static void scull_p_sub_del(struct scull_pipe *dev, struct file *filp);
+
+
+/*
+ * Each side of the ring has an owner bit in dev->flags: only the owner
+ * of SCULL_P_READING moves rp and only the owner of SCULL_P_WRITING
+ * moves wp. The other side's index is read with smp_load_acquire() and
+ * one's own is published with smp_store_release(), kfifo style, so a
+ * lone reader and a lone writer run against each other without taking
+ * dev->sem or any other sleeping lock. With more than one reader (or
+ * writer) the bit is contended and that side waits on it in turn.
+ */
+#define SCULL_P_READING 0
+#define SCULL_P_WRITING 1
+
+static int scull_p_lock(struct scull_pipe *dev, int side){
+    if (!test_and_set_bit_lock(side, &dev->flags))
+        return 0; /* uncontended: the single producer/consumer fast path */
+    if (wait_on_bit_lock(&dev->flags, side, TASK_INTERRUPTIBLE))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+static void scull_p_unlock(struct scull_pipe *dev, int side){
+    clear_bit_unlock(side, &dev->flags);
+    smp_mb__after_atomic();
+    wake_up_bit(&dev->flags, side);
+}
+
+/*
+ * Blocked readers and writers wait exclusively, at the tail of inq and
+ * outq, so each wakeup rouses only the oldest waiter of a side instead
+ * of the whole herd (poll() and epoll waiters still all wake, except
+ * EPOLLEXCLUSIVE ones). A woken task that leaves something behind for
+ * its own side passes the wakeup on to the next in line. Writers that
+ * need more than sndlowat wait non-exclusively, see scull_getwritespace().
+ */
+static void scull_p_pass_on(wait_queue_head_t *q, int ready){
+    if (ready)
+        wake_up_interruptible(q);
+}
+
+/****************** Statistics ******************/
+/*
+ * Per-CPU counters of each device, summed up only when
+ * /proc/scullpipe_stats is read, so they stay on. Sides are indexed by
+ * SCULL_P_READING and SCULL_P_WRITING. All fields are u64: the sum
+ * walks the struct as an array.
+ */
+#define SCULL_P_OCC_BUCKETS  8  /* ring fill in eighths, sampled at each write */
+#define SCULL_P_HIST_BUCKETS 20 /* <1us, then [2^(n-1), 2^n) us */
+struct scull_p_stats {
+    u64 bytes[2];      /* read out, written in */
+    u64 eagain[2];
+    u64 waits[2];      /* times a side found the ring empty/full and waited */
+    u64 blocked_ns[2]; /* spinning and sleeping in those waits */
+    u64 woken[2];      /* returns from sleep */
+    u64 useful[2];     /* waits that slept and went on to move data */
+    u64 sigio;
+    u64 occupancy[SCULL_P_OCC_BUCKETS];
+    u64 blocked[2][SCULL_P_HIST_BUCKETS];
+    u64 latency[SCULL_P_HIST_BUCKETS]; /* write to read, in stamped mode */
+};
+
+static int spacefree(struct scull_pipe *dev);
+
+static void scull_p_sigio(struct scull_pipe *dev){
+    if (!dev->async_queue)
+        return;
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    this_cpu_inc(dev->stats->sigio);
+}
+
+static void scull_p_blocked(struct scull_pipe *dev, int side, u64 ns){
+    this_cpu_inc(dev->stats->waits[side]);
+    this_cpu_add(dev->stats->blocked_ns[side], ns);
+    this_cpu_inc(dev->stats->blocked[side][min(fls64(ns / NSEC_PER_USEC), SCULL_P_HIST_BUCKETS - 1)]);
+}
+
+/* A stamped message or segment written at stamp has been read through filp */
+static void scull_p_latency(struct scull_pipe *dev, struct file *filp, u64 stamp){
+    u64 ns = ktime_get_ns() - stamp;
+
+    this_cpu_inc(dev->stats->latency[min(fls64(ns / NSEC_PER_USEC), SCULL_P_HIST_BUCKETS - 1)]);
+    scull_p_file(filp)->lat = ns;
+}
+
+/* Count what a read or write returned, and sample the ring after a write */
+static ssize_t scull_p_account(struct scull_pipe *dev, int side, ssize_t ret){
+    int size, used;
+
+    if (ret == -EAGAIN)
+        this_cpu_inc(dev->stats->eagain[side]);
+    if (ret <= 0)
+        return ret;
+    this_cpu_add(dev->stats->bytes[side], ret);
+    if (side == SCULL_P_WRITING && !dev->nshards && !dev->bcast) {
+        /* lockless, so keep a sample taken across a resize in range */
+        size = READ_ONCE(dev->buffersize) - 1;
+        used = clamp(size - spacefree(dev), 0, size);
+        this_cpu_inc(dev->stats->occupancy[used * SCULL_P_OCC_BUCKETS / (size + 1)]);
+    }
+    return ret;
+}
+
+/*
+ * Rings bigger than a page are built from order-0 pages mapped back to
+ * back by vmalloc, so a pipe of tens of megabytes never needs a
+ * physically contiguous block (and no compaction to find one), while
+ * rp/wp arithmetic still runs over one flat range. Small rings stay
+ * in kmalloc memory.
+ *
+ * Rings of closed pipes go to a pool (up to scull_p_pool_max bytes)
+ * instead of being freed, so open/close cycles reuse a warm ring of
+ * the same size. The list node sits in the idle ring itself. The
+ * shrinker gives the coldest ones back under memory pressure.
+ */
+struct scull_p_pooled {
+    struct list_head list;
+    size_t size;
+};
+
+static LIST_HEAD(scull_p_pool);
+static DEFINE_SPINLOCK(scull_p_pool_lock);
+static unsigned long scull_p_pool_bytes, scull_p_pool_count;
+static struct shrinker *scull_p_shrinker;
+
+static char *scull_p_ring_alloc(size_t size){
+    struct scull_p_pooled *p;
+
+    spin_lock(&scull_p_pool_lock);
+    list_for_each_entry(p, &scull_p_pool, list) {
+        if (p->size != size)
+            continue;
+        list_del(&p->list);
+        scull_p_pool_bytes -= size;
+        scull_p_pool_count--;
+        spin_unlock(&scull_p_pool_lock);
+        return (char *) p;
+    }
+    spin_unlock(&scull_p_pool_lock);
+    if (size <= PAGE_SIZE)
+        return kmalloc(size, GFP_KERNEL);
+    return vmalloc(size);
+}
+
+static void scull_p_ring_free(char *buffer, size_t size){
+    struct scull_p_pooled *p = (struct scull_p_pooled *) buffer;
+
+    if (!buffer)
+        return;
+    if (scull_p_shrinker && size >= sizeof(*p)) {
+        spin_lock(&scull_p_pool_lock);
+        if (scull_p_pool_bytes + size <= READ_ONCE(scull_p_pool_max)) {
+            p->size = size;
+            list_add(&p->list, &scull_p_pool); /* the warmest first */
+            scull_p_pool_bytes += size;
+            scull_p_pool_count++;
+            spin_unlock(&scull_p_pool_lock);
+            return;
+        }
+        spin_unlock(&scull_p_pool_lock);
+    }
+    kvfree(buffer);
+}
+
+/* Free up to nr pooled rings, the coldest first */
+static unsigned long scull_p_pool_drain(unsigned long nr){
+    struct scull_p_pooled *p, *next;
+    unsigned long freed = 0;
+    LIST_HEAD(victims);
+
+    spin_lock(&scull_p_pool_lock);
+    while (freed < nr && !list_empty(&scull_p_pool)) {
+        p = list_last_entry(&scull_p_pool, struct scull_p_pooled, list);
+        list_move(&p->list, &victims);
+        scull_p_pool_bytes -= p->size;
+        scull_p_pool_count--;
+        freed++;
+    }
+    spin_unlock(&scull_p_pool_lock);
+    list_for_each_entry_safe(p, next, &victims, list)
+        kvfree(p);
+    return freed;
+}
+
+static unsigned long scull_p_pool_count_objects(struct shrinker *s, struct shrink_control *sc){
+    return READ_ONCE(scull_p_pool_count) ? READ_ONCE(scull_p_pool_count) : SHRINK_EMPTY;
+}
+
+static unsigned long scull_p_pool_scan_objects(struct shrinker *s, struct shrink_control *sc){
+    return scull_p_pool_drain(sc->nr_to_scan);
+}
+
+/****************** Sharded mode: one sub-ring per CPU ******************/
+/*
+ * Writers pick the shard of the CPU they run on, or the next free one
+ * when another writer holds it, so they don't share a lock or an index.
+ * Each write becomes one segment (struct scull_p_seg, then the bytes).
+ * The reader takes whole segments from the shards in turn, or always
+ * the oldest one first in SCULL_P_MERGE_STAMP order. Bytes of one
+ * segment stay together; the order between writers is only kept by
+ * the stamp merge.
+ */
+struct scull_p_seg {
+    u64 stamp; /* ktime_get_ns() at write */
+    u32 len;
+};
+
+struct scull_p_shard {
+    char *buffer;
+    unsigned int mask;       /* size - 1, the size is a power of two */
+    unsigned int head, tail; /* free running: the writer moves head, the reader tail */
+    unsigned long lock;      /* bit 0: a writer owns the shard */
+    /* reader side: the rest of the segment at tail */
+    unsigned int seg_left;
+    u64 seg_stamp;
+};
+
+static unsigned int scull_p_shard_used(struct scull_p_shard *sh){
+    return READ_ONCE(sh->head) - READ_ONCE(sh->tail);
+}
+
+static void scull_p_shard_put(struct scull_p_shard *sh, unsigned int pos, const void *src, unsigned int len){
+    unsigned int off = pos & sh->mask, first = min(len, sh->mask + 1 - off);
+    memcpy(sh->buffer + off, src, first);
+    memcpy(sh->buffer, (const char *) src + first, len - first);
+}
+
+static int scull_p_shard_put_iter(struct scull_p_shard *sh, unsigned int pos, struct iov_iter *from, unsigned int len){
+    unsigned int off = pos & sh->mask, first = min(len, sh->mask + 1 - off);
+    if (copy_from_iter(sh->buffer + off, first, from) != first)
+        return -EFAULT;
+    return copy_from_iter(sh->buffer, len - first, from) != len - first ? -EFAULT : 0;
+}
+
+static void scull_p_shard_get(struct scull_p_shard *sh, unsigned int pos, void *dst, unsigned int len){
+    unsigned int off = pos & sh->mask, first = min(len, sh->mask + 1 - off);
+    memcpy(dst, sh->buffer + off, first);
+    memcpy((char *) dst + first, sh->buffer, len - first);
+}
+
+static int scull_p_shard_get_iter(struct scull_p_shard *sh, unsigned int pos, struct iov_iter *to, unsigned int len){
+    unsigned int off = pos & sh->mask, first = min(len, sh->mask + 1 - off);
+    if (copy_to_iter(sh->buffer + off, first, to) != first)
+        return -EFAULT;
+    return copy_to_iter(sh->buffer, len - first, to) != len - first ? -EFAULT : 0;
+}
+
+/* Room for a segment header and at least one byte */
+static int scull_p_shard_writable(struct scull_p_shard *sh){
+    return sh->mask + 1 - scull_p_shard_used(sh) > sizeof(struct scull_p_seg);
+}
+
+static int scull_p_shards_writable(struct scull_pipe *dev){
+    int i;
+    for (i = 0; i < dev->nshards; i++)
+        if (scull_p_shard_writable(dev->shards + i))
+            return 1;
+    return 0;
+}
+
+static int scull_p_shards_readable(struct scull_pipe *dev){
+    int i;
+    for (i = 0; i < dev->nshards; i++)
+        if (dev->shards[i].seg_left || scull_p_shard_used(dev->shards + i))
+            return 1;
+    return 0;
+}
+
+/*
+ * Own a shard with room, starting with this CPU's. Returns NULL when
+ * there is none; *busy tells if one had room but another writer had it.
+ */
+static struct scull_p_shard *scull_p_shard_claim(struct scull_pipe *dev, int *busy){
+    int i, start = raw_smp_processor_id() % dev->nshards;
+    struct scull_p_shard *sh;
+
+    *busy = 0;
+    for (i = 0; i < dev->nshards; i++) {
+        sh = dev->shards + (start + i) % dev->nshards;
+        if (!scull_p_shard_writable(sh))
+            continue;
+        if (test_and_set_bit_lock(0, &sh->lock)) {
+            *busy = 1;
+            continue;
+        }
+        if (scull_p_shard_writable(sh))
+            return sh;
+        clear_bit_unlock(0, &sh->lock);
+    }
+    return NULL;
+}
+
+static ssize_t scull_p_shard_write(struct scull_pipe *dev, struct file *filp, struct iov_iter *from){
+    size_t count = iov_iter_count(from);
+    struct scull_p_shard *sh;
+    struct scull_p_seg seg;
+    unsigned int head, room;
+    int busy;
+
+    while (!(sh = scull_p_shard_claim(dev, &busy))) {
+        if (busy) { /* there is room, another writer is copying into it */
+            cond_resched();
+            continue;
+        }
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible_exclusive(dev->outq, scull_p_shards_writable(dev)))
+            return -ERESTARTSYS;
+    }
+    head = sh->head;
+    /* pairs with the release of tail in scull_p_shard_read */
+    room = sh->mask + 1 - (head - smp_load_acquire(&sh->tail));
+    seg.len = (u32) min(count, (size_t) (room - sizeof(seg)));
+    seg.stamp = ktime_get_ns();
+    if (scull_p_shard_put_iter(sh, head + sizeof(seg), from, seg.len)) {
+        clear_bit_unlock(0, &sh->lock);
+        return -EFAULT;
+    }
+    scull_p_shard_put(sh, head, &seg, sizeof(seg));
+    /* publish the whole segment at once */
+    smp_store_release(&sh->head, head + sizeof(seg) + seg.len);
+    clear_bit_unlock(0, &sh->lock);
+
+    scull_p_pass_on(&dev->outq, scull_p_shards_writable(dev));
+    wake_up_interruptible(&dev->inq);
+    scull_p_sigio(dev);
+    return seg.len;
+}
+
+/* Load the next segment header of a shard if needed; reader side owned */
+static int scull_p_shard_ready(struct scull_p_shard *sh){
+    struct scull_p_seg seg;
+    if (sh->seg_left)
+        return 1;
+    /* pairs with the release of head in scull_p_shard_write */
+    if (smp_load_acquire(&sh->head) == sh->tail)
+        return 0;
+    scull_p_shard_get(sh, sh->tail, &seg, sizeof(seg));
+    sh->seg_left = seg.len;
+    sh->seg_stamp = seg.stamp;
+    smp_store_release(&sh->tail, sh->tail + sizeof(seg));
+    return 1;
+}
 
+/* Pick the shard to read from according to dev->merge */
+static struct scull_p_shard *scull_p_shard_next(struct scull_pipe *dev){
+    struct scull_p_shard *sh, *best = NULL;
+    int i;
+
+    for (i = 0; i < dev->nshards; i++) {
+        sh = dev->shards + (dev->rr + i) % dev->nshards;
+        if (!scull_p_shard_ready(sh))
+            continue;
+        if (READ_ONCE(dev->merge) == SCULL_P_MERGE_RR)
+            return sh;
+        if (!best || sh->seg_stamp < best->seg_stamp)
+            best = sh;
+    }
+    return best;
+}
+
+static ssize_t scull_p_shard_read(struct scull_pipe *dev, struct file *filp, struct iov_iter *to){
+    size_t count = iov_iter_count(to);
+    struct scull_p_shard *sh;
+    size_t done = 0;
+    unsigned int n;
+
+    if (scull_p_lock(dev, SCULL_P_READING))
+        return -ERESTARTSYS;
+    while (!scull_p_shards_readable(dev)) {
+        scull_p_unlock(dev, SCULL_P_READING);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible_exclusive(dev->inq, scull_p_shards_readable(dev)))
+            return -ERESTARTSYS;
+        if (scull_p_lock(dev, SCULL_P_READING))
+            return -ERESTARTSYS;
+    }
+    while (done < count && (sh = scull_p_shard_next(dev))) {
+        n = (unsigned int) min(count - done, (size_t) sh->seg_left);
+        if (scull_p_shard_get_iter(sh, sh->tail, to, n))
+            break;
+        sh->seg_left -= n;
+        if (!sh->seg_left && dev->stamps)
+            scull_p_latency(dev, filp, sh->seg_stamp);
+        /* hand the space back to the writers */
+        smp_store_release(&sh->tail, sh->tail + n);
+        done += n;
+        /* round-robin moves on once a segment is done */
+        if (!sh->seg_left)
+            dev->rr = (int) (sh - dev->shards + 1) % dev->nshards;
+    }
+    scull_p_unlock(dev, SCULL_P_READING);
+    if (!done)
+        return -EFAULT;
+    scull_p_pass_on(&dev->inq, scull_p_shards_readable(dev));
+    wake_up_interruptible(&dev->outq);
+    return (ssize_t) done;
+}
+
+static void scull_p_shards_free(struct scull_pipe *dev){
+    int i;
+    for (i = 0; dev->shards && i < dev->nshards; i++)
+        scull_p_ring_free(dev->shards[i].buffer, dev->shards[i].mask + 1);
+    kfree(dev->shards);
+    dev->shards = NULL;
+    dev->nshards = 0;
+}
+
+/* Set up dev->shard_cfg shards of about buffersize bytes each; semaphore held */
+static int scull_p_shards_alloc(struct scull_pipe *dev){
+    unsigned int size = roundup_pow_of_two(max_t(unsigned int, dev->buffersize, 2 * sizeof(struct scull_p_seg)));
+    int i, n = dev->shard_cfg == SCULL_P_SHARDS_PER_CPU ?
+        min_t(int, nr_cpu_ids, SCULL_P_MAX_SHARDS) : dev->shard_cfg;
+
+    if (n <= 0)
+        return 0;
+    dev->shards = kcalloc(n, sizeof(struct scull_p_shard), GFP_KERNEL);
+    if (!dev->shards)
+        return -ENOMEM;
+    dev->nshards = n;
+    dev->rr = 0;
+    for (i = 0; i < n; i++) {
+        dev->shards[i].buffer = scull_p_ring_alloc(size);
+        if (!dev->shards[i].buffer) {
+            scull_p_shards_free(dev);
+            return -ENOMEM;
+        }
+        dev->shards[i].mask = size - 1;
+    }
+    return 0;
+}
+
+/****************** Priority lanes ******************/
+/*
+ * Lanes 1 .. SCULL_P_LANES - 1 are small rings beside the main one
+ * (lane 0), laid out like shards: each write is one segment and is
+ * kept whole. A reader always takes the waiting message of the highest
+ * lane before anything else, so control traffic doesn't queue behind
+ * bulk data. The writers of a lane take turns on its lock bit.
+ */
+static void scull_p_lanes_free(struct scull_pipe *dev){
+    int i;
+    for (i = 0; dev->lanes && i < SCULL_P_LANES - 1; i++)
+        kfree(dev->lanes[i].buffer);
+    kfree(dev->lanes);
+    dev->lanes = NULL;
+}
+
+/* semaphore held */
+static int scull_p_lanes_alloc(struct scull_pipe *dev){
+    int i;
+
+    if (!dev->lanes_cfg)
+        return 0;
+    dev->lanes = kcalloc(SCULL_P_LANES - 1, sizeof(struct scull_p_shard), GFP_KERNEL);
+    if (!dev->lanes)
+        return -ENOMEM;
+    for (i = 0; i < SCULL_P_LANES - 1; i++) {
+        dev->lanes[i].buffer = kmalloc(SCULL_P_LANE_BUFFER, GFP_KERNEL);
+        if (!dev->lanes[i].buffer) {
+            scull_p_lanes_free(dev);
+            return -ENOMEM;
+        }
+        dev->lanes[i].mask = SCULL_P_LANE_BUFFER - 1;
+    }
+    return 0;
+}
+
+static int scull_p_lanes_pending(struct scull_pipe *dev){
+    int i;
+    for (i = 0; dev->lanes && i < SCULL_P_LANES - 1; i++)
+        if (dev->lanes[i].seg_left || scull_p_shard_used(dev->lanes + i))
+            return 1;
+    return 0;
+}
+
+static int scull_p_lane_room(struct scull_p_shard *sh, size_t need){
+    return sh->mask + 1 - scull_p_shard_used(sh) >= need;
+}
+
+static void scull_p_lane_unlock(struct scull_p_shard *sh){
+    clear_bit_unlock(0, &sh->lock);
+    smp_mb__after_atomic();
+    wake_up_bit(&sh->lock, 0);
+}
+
+static ssize_t scull_p_lane_write(struct scull_pipe *dev, struct file *filp, int lane, struct iov_iter *from){
+    struct scull_p_shard *sh = dev->lanes + lane - 1;
+    size_t count = iov_iter_count(from), need = sizeof(struct scull_p_seg) + count;
+    struct scull_p_seg seg;
+    unsigned int head;
+
+    if (need > sh->mask + 1)
+        return -EMSGSIZE; /* a lane message is never split */
+    if (wait_on_bit_lock(&sh->lock, 0, TASK_INTERRUPTIBLE))
+        return -ERESTARTSYS;
+    while (!scull_p_lane_room(sh, need)) {
+        scull_p_lane_unlock(sh);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        /* not exclusive: the wakeup may have been for the main ring */
+        if (wait_event_interruptible(dev->outq, scull_p_lane_room(sh, need)))
+            return -ERESTARTSYS;
+        if (wait_on_bit_lock(&sh->lock, 0, TASK_INTERRUPTIBLE))
+            return -ERESTARTSYS;
+    }
+    head = sh->head;
+    seg.len = (u32) count;
+    seg.stamp = ktime_get_ns();
+    if (scull_p_shard_put_iter(sh, head + sizeof(seg), from, seg.len)) {
+        scull_p_lane_unlock(sh);
+        return -EFAULT;
+    }
+    scull_p_shard_put(sh, head, &seg, sizeof(seg));
+    smp_store_release(&sh->head, head + (unsigned int) need);
+    scull_p_lane_unlock(sh);
+
+    /* no watermark here: control traffic goes out at once */
+    wake_up_interruptible(&dev->inq);
+    scull_p_sigio(dev);
+    return (ssize_t) count;
+}
+
+/* The next message of the highest busy lane, or 0; read side owned */
+static ssize_t scull_p_lane_read(struct scull_pipe *dev, struct iov_iter *to){
+    struct scull_p_shard *sh;
+    unsigned int n;
+    int i;
+
+    for (i = SCULL_P_LANES - 2; dev->lanes && i >= 0; i--) {
+        sh = dev->lanes + i;
+        if (!scull_p_shard_ready(sh))
+            continue;
+        if (sh->seg_left > iov_iter_count(to))
+            return -EMSGSIZE; /* stays first in line */
+        n = sh->seg_left;
+        if (scull_p_shard_get_iter(sh, sh->tail, to, n))
+            return -EFAULT;
+        sh->seg_left = 0;
+        smp_store_release(&sh->tail, sh->tail + n);
+        wake_up_interruptible(&dev->outq);
+        return n;
+    }
+    return 0;
+}
+
+/****************** Mapped mode: the ring is shared with user space ******************/
+/*
+ * One vmalloc_user() area: the struct scull_p_ring control page, then
+ * ring_size bytes of data. Producer and consumer move head and tail
+ * themselves in the mapping; the driver only reads them to answer
+ * poll() and wakes sleepers when a side rings SCULL_P_IOCRING. The
+ * whole control page is writable by user space, so the driver keeps
+ * its own copy of the size and never reads ring->size back.
+ */
+static int scull_p_ring_alloc_mapped(struct scull_pipe *dev){
+    u32 size = roundup_pow_of_two(max_t(u32, dev->buffersize, PAGE_SIZE));
+
+    if (!dev->mmap_cfg)
+        return 0;
+    dev->ring = vmalloc_user(PAGE_SIZE + size);
+    if (!dev->ring)
+        return -ENOMEM;
+    dev->ring_size = size;
+    dev->ring->size = size;
+    dev->ring->data_offset = PAGE_SIZE;
+    return 0;
+}
+
+static unsigned int scull_p_ring_poll(struct scull_pipe *dev){
+    struct scull_p_ring *ring = dev->ring;
+    u32 head = smp_load_acquire(&ring->head), tail = smp_load_acquire(&ring->tail);
+    unsigned int mask = 0;
+
+    if (head != tail)
+        mask |= POLLIN | POLLRDNORM;
+    if (head - tail < dev->ring_size)
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma){
+    struct scull_pipe *dev = scull_p_dev(filp);
+    int ret = -EINVAL;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    /* the whole area at once: control page and data */
+    if (dev->ring && !vma->vm_pgoff && vma->vm_end - vma->vm_start == PAGE_SIZE + dev->ring_size)
+        ret = remap_vmalloc_range(vma, dev->ring, 0);
+    up(&dev->sem);
+    return ret;
+}
+
+static long scull_p_ring_doorbell(struct scull_pipe *dev, unsigned long arg){
+    if (!dev->ring)
+        return -EINVAL;
+    if (arg & ~(unsigned long) (SCULL_P_RING_WAKE_READER | SCULL_P_RING_WAKE_WRITER))
+        return -EINVAL;
+    if (arg & SCULL_P_RING_WAKE_READER) {
+        wake_up_interruptible(&dev->inq);
+        scull_p_sigio(dev);
+    }
+    if (arg & SCULL_P_RING_WAKE_WRITER)
+        wake_up_interruptible(&dev->outq);
+    return 0;
+}
+
+/* The last one out frees the ring(s); semaphore held */
+static void scull_p_free_buffers(struct scull_pipe *dev){
+    scull_p_ring_free(dev->buffer, (size_t) dev->buffersize);
+    dev->buffer = NULL;
+    scull_p_shards_free(dev);
+    scull_p_lanes_free(dev);
+    vfree(dev->ring);
+    dev->ring = NULL;
+}
 
 static int scull_p_open(struct inode *inode, struct file *filp){
     struct scull_pipe *dev;
+    struct scull_p_file *pf;
     // inode will be the same for every process opening the file, but filp will be differnt
     // same dev will be from each be 1-1 with /dev/file
     dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-    filp->private_data = dev;
-    if (down_interruptible(&dev->sem))
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;
+    filp->private_data = pf;
+    if (down_interruptible(&dev->sem)) {
+        kfree(pf);
         return -ERESTARTSYS;
-    if (!dev->buffer){
-        // allocate the buffer
-        dev->buffer = (char *) kmalloc(scull_p_buffer, GFP_KERNEL);
-        if (!dev->buffer) {
+    }
+    if (!dev->buffer && !dev->ring){
+        // allocate the buffer, nobody else has the device open
+        dev->buffersize = dev->buffer_cfg ? dev->buffer_cfg : READ_ONCE(scull_p_buffer);
+        /* scull_p_buffer may come straight from the module parameter */
+        dev->buffersize = clamp_t(int, dev->buffersize, SCULL_P_MIN_BUFFER, SCULL_P_MAX_BUFFER);
+        /* mapped mode moves its data through dev->ring only */
+        if (!dev->mmap_cfg) {
+            dev->buffer = scull_p_ring_alloc((size_t) dev->buffersize);
+            if (!dev->buffer) {
+                up(&dev->sem);
+                kfree(pf);
+                return -ENOMEM;
+            }
+        }
+        dev->end = dev->buffer ? dev->buffer + dev->buffersize : NULL;
+        dev->rp = dev->wp = dev->buffer;  /* buffer is empty condition */
+        dev->records = dev->record_cfg;
+        dev->bcast = dev->bcast_cfg;
+        dev->bhead = dev->bresv = dev->btail = 0;
+        if (scull_p_shards_alloc(dev) || scull_p_ring_alloc_mapped(dev) || scull_p_lanes_alloc(dev)) {
+            scull_p_shards_free(dev);
+            vfree(dev->ring);
+            dev->ring = NULL;
+            scull_p_ring_free(dev->buffer, (size_t) dev->buffersize);
+            dev->buffer = NULL;
             up(&dev->sem);
+            kfree(pf);
             return -ENOMEM;
         }
+        dev->stamps = dev->stamp_cfg && (dev->records || dev->nshards);
+    }
+    /* a broadcast reader gets its own cursor */
+    if (dev->bcast && (filp->f_mode & FMODE_READ) && scull_p_sub_add(dev, filp)) {
+        if (dev->nreaders + dev->nwriters == 0)
+            scull_p_free_buffers(dev);
+        up(&dev->sem);
+        kfree(pf);
+        return -ENOMEM;
     }
-    dev->buffersize = scull_p_buffer;
-    dev->end = dev->buffer + dev->buffersize;
-    dev->rp = dev->wp = dev->buffer;  /* buffer is empty condition */
     /* use f_mode to keep track of readers & writers */
     if (filp->f_mode & FMODE_READ)
         dev->nreaders++;
@@ -58,171 +751,1115 @@ static int scull_p_open(struct inode *inode, struct file *filp){
     return nonseekable_open(inode, filp);
 }
 static int scull_p_release(struct inode *inode, struct file *filp){
-    struct scull_pipe *dev = filp -> private_data;
+    struct scull_pipe *dev = scull_p_dev(filp);
     /* remove this filp from the asynchronously notified file's */
     scull_p_fasync(-1, filp, 0);
     down(&dev->sem);
+    if (dev->bcast && (filp->f_mode & FMODE_READ))
+        scull_p_sub_del(dev, filp);
     if (filp->f_mode & FMODE_READ)
         dev->nreaders--;
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
-    if (dev->nreaders + dev->nwriters == 0){
-        kfree(dev->buffer);
-        dev->buffer = NULL;
-    }
+    if (dev->nreaders + dev->nwriters == 0)
+        scull_p_free_buffers(dev);
     up(&dev->sem);
+    kfree(filp->private_data);
     return 0;
 }
 
 
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
-    struct scull_pipe *dev = filp->private_data;
-    if (down_interruptible(&dev->sem))
+static int scull_p_space(struct scull_pipe *dev, char *rp, char *wp){
+    if (rp == wp)
+        return dev->buffersize - 1;
+    return (int) (((rp + dev->buffersize - wp) % dev->buffersize) - 1);
+}
+static int spacefree(struct scull_pipe *dev){
+    return scull_p_space(dev, READ_ONCE(dev->rp), READ_ONCE(dev->wp));
+}
+
+/*
+ * Watermarks, like SO_RCVLOWAT/SO_SNDLOWAT: readers are woken (and
+ * poll() reports POLLIN) once rcvlowat bytes are queued, writers once
+ * sndlowat bytes are free, so small writes and reads don't bounce
+ * the other side awake for every byte. Both are capped by the ring size.
+ * Record mode ignores rcvlowat: messages need their header and all
+ * their bytes free, so a ring of them can stop filling short of any
+ * mark and leave both sides asleep. One whole message is readable.
+ */
+static int scull_p_readable(struct scull_pipe *dev){
+    int size = READ_ONCE(dev->buffersize) - 1, used = size - spacefree(dev);
+    if (dev->records)
+        return used > 0; /* writers publish whole messages only */
+    return used >= min(READ_ONCE(dev->rcvlowat), size) || scull_p_lanes_pending(dev);
+}
+static int scull_p_writable(struct scull_pipe *dev){
+    int size = READ_ONCE(dev->buffersize) - 1;
+    return spacefree(dev) >= min(READ_ONCE(dev->sndlowat), size);
+}
+/* Readable, with no other reader's handoff post ahead (see scull_p_handoff_take) */
+static int scull_p_ring_ready(struct scull_pipe *dev){
+    return !READ_ONCE(dev->handoff) && scull_p_readable(dev);
+}
+static void scull_p_wake_readers(struct scull_pipe *dev){
+    if (!scull_p_readable(dev))
+        return; /* not a batch yet */
+    wake_up_interruptible(&dev->inq); // blocked in read() and select()
+    /* and signal asynchronous readers if there are any registered with fnctl(F_ASYNC) */
+    scull_p_sigio(dev);
+}
+static void scull_p_wake_writers(struct scull_pipe *dev){
+    if (scull_p_writable(dev))
+        wake_up_interruptible(&dev->outq);
+}
+
+/*
+ * Busy-poll cond for up to the device's spin window; evaluates to
+ * whether it came true. Gives up early for anyone else who needs the
+ * CPU, and for signals.
+ */
+#define scull_p_spin(dev, cond) ({                                          \
+    u64 __until = ktime_get_ns() + READ_ONCE((dev)->spin_ns);               \
+    bool __ready;                                                           \
+    while (!(__ready = (cond)) && ktime_get_ns() < __until &&               \
+           !need_resched() && !signal_pending(current))                     \
+        cpu_relax();                                                        \
+    __ready;                                                                \
+})
+
+#define SCULL_P_SPIN_START_NS 2000
+
+/*
+ * Tune the window after a wait of waited ns, haltpoll style: a wait
+ * that outlasted the window but not the budget would have been saved
+ * by a longer one, so double it; one that outlasted the budget was
+ * spun for in vain, so halve it.
+ */
+static void scull_p_spin_tune(struct scull_pipe *dev, u64 waited){
+    u64 max = (u64) READ_ONCE(dev->spin_us) * NSEC_PER_USEC;
+    u64 ns = READ_ONCE(dev->spin_ns);
+
+    if (waited <= ns)
+        return;
+    if (waited <= max)
+        ns = ns ? min(ns * 2, max) : min((u64) SCULL_P_SPIN_START_NS, max);
+    else if ((ns /= 2) < SCULL_P_SPIN_START_NS)
+        ns = 0;
+    WRITE_ONCE(dev->spin_ns, (unsigned int) ns);
+}
+
+/* Own the read side with data in the ring. On error the read side is not held. */
+static int scull_p_getreaddata(struct scull_pipe *dev, struct file *filp){
+    bool slept = false;
+    u64 start, waited;
+    if (scull_p_lock(dev, SCULL_P_READING))
         return -ERESTARTSYS;
-    /* wait until writer writes something */
-    while(dev->rp == dev->wp) { // nothing to read
-        up(&dev->sem); // release the lock
+    /* wait until writer writes a batch */
+    while(!scull_p_ring_ready(dev)) { // below the low watermark, or behind a handoff
+        if ((filp->f_flags & O_NONBLOCK) && dev->rp != READ_ONCE(dev->wp) && !READ_ONCE(dev->handoff))
+            break; /* non-blocking readers take what is there */
+        scull_p_unlock(dev, SCULL_P_READING); // let other readers in
         /* For processes that cannot block return error if data not available */
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
-        PDEBUG("%s reading: going to sleep\n", current->comm);
-        /* use the inq wait queue to wait on a condition or wake up */
-        if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-            return -ERESTARTSYS;
+        start = ktime_get_ns();
+        if (!scull_p_spin(dev, scull_p_ring_ready(dev))) {
+            PDEBUG("%s reading: going to sleep\n", current->comm);
+            /* use the inq wait queue to wait on a condition or wake up */
+            if (wait_event_interruptible_exclusive(dev->inq, scull_p_ring_ready(dev)))
+                return -ERESTARTSYS;
+            this_cpu_inc(dev->stats->woken[SCULL_P_READING]);
+            slept = true;
+        }
+        waited = ktime_get_ns() - start;
+        scull_p_blocked(dev, SCULL_P_READING, waited);
+        if (READ_ONCE(dev->spin_us))
+            scull_p_spin_tune(dev, waited);
         /* after all the processes have been awakened by the wait_queue */
-        if (down_interruptible(&dev->sem))
+        if (scull_p_lock(dev, SCULL_P_READING))
             return -ERESTARTSYS;
     }
-    /* Get the amount of indexes to read */
-    if (dev->wp > dev->rp)
-        count = min(count, dev->wp - dev->rp);
-    else
-        count = min(count, dev->end - dev->rp);
+    if (slept)
+        this_cpu_inc(dev->stats->useful[SCULL_P_READING]);
+    return 0;
+}
 
-    if (copy_to_user(buf, dev->rp, count)) {
-        up(&dev->sem);
+/****************** Record mode: each write() is one message ******************/
+/*
+ * A message is stored as a u32 length, its u64 write time in stamped
+ * mode, and then its bytes, wrapping
+ * around the ring like plain data. Writers wait for room for the whole
+ * message and readers only ever take whole messages.
+ */
+#define SCULL_P_MSG_HDR sizeof(u32)
+
+static size_t scull_p_msg_hdr(struct scull_pipe *dev){
+    return SCULL_P_MSG_HDR + (dev->stamps ? sizeof(u64) : 0);
+}
+
+/* Copy len bytes into the ring at pos, from src or else the iterator; returns the new position */
+static char *scull_p_put(struct scull_pipe *dev, char *pos, const void *src, struct iov_iter *from, size_t len){
+    size_t first = min(len, (size_t) (dev->end - pos));
+    if (from ? copy_from_iter(pos, first, from) != first ||
+               copy_from_iter(dev->buffer, len - first, from) != len - first :
+        (memcpy(pos, src, first), memcpy(dev->buffer, (const char *) src + first, len - first), 0))
+        return NULL;
+    pos += len;
+    return pos >= dev->end ? pos - dev->buffersize : pos;
+}
+
+/* Copy len bytes out of the ring at pos, to dst or else the iterator; returns the new position */
+static char *scull_p_get(struct scull_pipe *dev, char *pos, void *dst, struct iov_iter *to, size_t len){
+    size_t first = min(len, (size_t) (dev->end - pos));
+    if (to ? copy_to_iter(pos, first, to) != first ||
+             copy_to_iter(dev->buffer, len - first, to) != len - first :
+        (memcpy(dst, pos, first), memcpy((char *) dst + first, dev->buffer, len - first), 0))
+        return NULL;
+    pos += len;
+    return pos >= dev->end ? pos - dev->buffersize : pos;
+}
+
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp, int need);
+
+static ssize_t scull_p_msg_write(struct scull_pipe *dev, struct file *filp, struct iov_iter *from){
+    size_t count = iov_iter_count(from);
+    size_t hdr = scull_p_msg_hdr(dev);
+    u32 len = (u32) count;
+    u64 stamp;
+    char *wp;
+    int result;
+
+    if (count > (size_t) dev->buffersize - 1 - hdr)
+        return -EMSGSIZE; /* would never fit */
+    if (scull_p_lock(dev, SCULL_P_WRITING))
+        return -ERESTARTSYS;
+    result = scull_getwritespace(dev, filp, (int) (hdr + count));
+    if (result)
+        return result;
+    /* the space was checked against the reader's release of rp */
+    wp = scull_p_put(dev, dev->wp, &len, NULL, SCULL_P_MSG_HDR);
+    if (dev->stamps) {
+        stamp = ktime_get_ns();
+        wp = scull_p_put(dev, wp, &stamp, NULL, sizeof(stamp));
+    }
+    wp = scull_p_put(dev, wp, NULL, from, count);
+    if (!wp) { /* nothing was published */
+        scull_p_unlock(dev, SCULL_P_WRITING);
         return -EFAULT;
     }
-    dev->rp+=count;
-    /* Reset reader pointer if its at the last index of the buffer */
-    if (dev->rp == dev->end)
-        dev->rp = dev->buffer;
+    smp_store_release(&dev->wp, wp);
+    scull_p_unlock(dev, SCULL_P_WRITING);
 
-    /* finally, awake any writers and return */
-    wake_up_interruptible(&dev->outq);
-    return count;
+    scull_p_wake_readers(dev);
+    scull_p_pass_on(&dev->outq, scull_p_writable(dev));
+    return (ssize_t) count;
+}
+
+/*
+ * Take whole messages into the iterator, at most max of them,
+ * storing each length in lens if given. The first message must fit.
+ * Returns the number of messages, *bytes holds their total length.
+ */
+static int scull_p_msg_recv(struct scull_pipe *dev, struct file *filp, struct iov_iter *to,
+                            u32 __user *lens, u32 max, size_t *bytes){
+    char *rp, *wp, *next;
+    u64 stamp = 0;
+    u32 len;
+    int n = 0, result;
 
+    *bytes = 0;
+    result = scull_p_getreaddata(dev, filp);
+    if (result)
+        return result;
+    rp = dev->rp;
+    /* pairs with the release in scull_p_msg_write */
+    wp = smp_load_acquire(&dev->wp);
+    while (rp != wp && n < max) {
+        next = scull_p_get(dev, rp, &len, NULL, SCULL_P_MSG_HDR);
+        if (dev->stamps)
+            next = scull_p_get(dev, next, &stamp, NULL, sizeof(stamp));
+        if (len > iov_iter_count(to)) {
+            if (!n)
+                n = -EMSGSIZE; /* left in the ring for a larger buffer */
+            break;
+        }
+        if (lens && put_user(len, lens + n))
+            break;
+        next = scull_p_get(dev, next, NULL, to, len);
+        if (!next)
+            break;
+        rp = next;
+        *bytes += len;
+        n++;
+        if (dev->stamps)
+            scull_p_latency(dev, filp, stamp);
+    }
+    smp_store_release(&dev->rp, rp);
+    scull_p_unlock(dev, SCULL_P_READING);
+    if (!n)
+        return -EFAULT;
+    if (n > 0) {
+        scull_p_wake_writers(dev);
+        scull_p_pass_on(&dev->inq, scull_p_readable(dev));
+    }
+    return n;
 }
-static int spacefree(struct scull_pipe *dev){
-    if (dev->rp == dev->wp)
-        return dev->buffersize - 1;
-    return (int) (((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1);
+
+/****************** Broadcast mode: every reader sees every byte ******************/
+/*
+ * The ring is written once and each open reader follows it with its
+ * own cursor (struct scull_p_sub). Positions run free in u64: byte
+ * pos lives at buffer[pos % buffersize]. With SCULL_P_BCAST_BLOCK
+ * writers wait for the slowest reader (btail, the lowest cursor); with
+ * SCULL_P_BCAST_DROP they never wait and overwrite the oldest bytes,
+ * and a reader that fell behind gets -EOVERFLOW once, then carries on
+ * from the oldest byte still there. bresv is moved before a writer
+ * overwrites anything so a reader can tell if its copy was torn.
+ */
+struct scull_p_sub {
+    struct list_head list;
+    struct mutex lock; /* one read at a time on a file */
+    u64 pos;           /* next byte for this reader */
+    u64 overruns;      /* bytes dropped, see SCULL_P_IOCQOVERRUN */
+};
+
+/* The slowest cursor; writers in block mode may not pass it by more than the ring */
+static void scull_p_sub_tail(struct scull_pipe *dev){
+    struct scull_p_sub *sub;
+    u64 tail = smp_load_acquire(&dev->bhead);
+    spin_lock(&dev->sub_lock);
+    list_for_each_entry(sub, &dev->subs, list)
+        tail = min(tail, READ_ONCE(sub->pos));
+    WRITE_ONCE(dev->btail, tail);
+    spin_unlock(&dev->sub_lock);
 }
 
-/* Wait for space for writing; caller must hold device semaphore. On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp) {
+/* semaphore held */
+static int scull_p_sub_add(struct scull_pipe *dev, struct file *filp){
+    struct scull_p_sub *sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+    if (!sub)
+        return -ENOMEM;
+    mutex_init(&sub->lock);
+    sub->pos = READ_ONCE(dev->bhead); /* new readers start with new data */
+    spin_lock(&dev->sub_lock);
+    list_add_tail(&sub->list, &dev->subs);
+    dev->nsubs++;
+    spin_unlock(&dev->sub_lock);
+    scull_p_file(filp)->sub = sub;
+    scull_p_sub_tail(dev); /* the old tail may be long gone if there were no readers */
+    return 0;
+}
 
-    while(spacefree(dev) == 0){ /* full */
+/* semaphore held */
+static void scull_p_sub_del(struct scull_pipe *dev, struct file *filp){
+    struct scull_p_sub *sub = scull_p_file(filp)->sub;
+    if (!sub)
+        return;
+    spin_lock(&dev->sub_lock);
+    list_del(&sub->list);
+    dev->nsubs--;
+    spin_unlock(&dev->sub_lock);
+    kfree(sub);
+    /* it may have been the one holding writers back */
+    scull_p_sub_tail(dev);
+    wake_up_interruptible_all(&dev->outq);
+}
+
+static char *scull_p_bpos(struct scull_pipe *dev, u64 pos){
+    u32 rem;
+    div_u64_rem(pos, (u32) dev->buffersize, &rem);
+    return dev->buffer + rem;
+}
+
+/* Room for the next write; without readers or in drop mode, the whole ring */
+static u64 scull_p_bspace(struct scull_pipe *dev){
+    u64 used;
+    if (READ_ONCE(dev->bcast) == SCULL_P_BCAST_DROP || !READ_ONCE(dev->nsubs))
+        return (u64) dev->buffersize;
+    used = READ_ONCE(dev->bhead) - READ_ONCE(dev->btail);
+    return used < (u64) dev->buffersize ? (u64) dev->buffersize - used : 0;
+}
+
+static ssize_t scull_p_bcast_write(struct scull_pipe *dev, struct file *filp, struct iov_iter *from){
+    u64 head, n;
+
+    if (scull_p_lock(dev, SCULL_P_WRITING))
+        return -ERESTARTSYS;
+    while (!scull_p_bspace(dev)) {
+        scull_p_unlock(dev, SCULL_P_WRITING);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible_exclusive(dev->outq, scull_p_bspace(dev)))
+            return -ERESTARTSYS;
+        if (scull_p_lock(dev, SCULL_P_WRITING))
+            return -ERESTARTSYS;
+    }
+    head = dev->bhead;
+    n = min_t(u64, iov_iter_count(from), scull_p_bspace(dev));
+    /* claim the bytes about to be overwritten before touching them */
+    WRITE_ONCE(dev->bresv, head + n);
+    smp_wmb();
+    if (!scull_p_put(dev, scull_p_bpos(dev, head), NULL, from, (size_t) n)) {
+        WRITE_ONCE(dev->bresv, head);
+        scull_p_unlock(dev, SCULL_P_WRITING);
+        return -EFAULT;
+    }
+    smp_store_release(&dev->bhead, head + n);
+    scull_p_unlock(dev, SCULL_P_WRITING);
+
+    /* every subscriber wants this one */
+    wake_up_interruptible_all(&dev->inq);
+    scull_p_sigio(dev);
+    return (ssize_t) n;
+}
+
+static ssize_t scull_p_bcast_read(struct scull_pipe *dev, struct file *filp, struct iov_iter *to){
+    struct scull_p_sub *sub = scull_p_file(filp)->sub;
+    u64 head, size = (u64) dev->buffersize, n;
+    ssize_t ret;
+
+    if (!sub)
+        return -EBADF;
+    /* a non-blocking reader doesn't wait for another thread's read either */
+    if (filp->f_flags & O_NONBLOCK) {
+        if (!mutex_trylock(&sub->lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&sub->lock)) {
+        return -ERESTARTSYS;
+    }
+    while ((head = smp_load_acquire(&dev->bhead)) == sub->pos) {
+        ret = -EAGAIN;
+        if (filp->f_flags & O_NONBLOCK)
+            goto out;
+        /* sleep without the cursor, then look again */
+        mutex_unlock(&sub->lock);
+        if (wait_event_interruptible(dev->inq, READ_ONCE(dev->bhead) != READ_ONCE(sub->pos)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&sub->lock))
+            return -ERESTARTSYS;
+    }
+    ret = -EOVERFLOW;
+    if (head - sub->pos > size) { /* overwritten under us */
+        sub->overruns += head - size - sub->pos;
+        WRITE_ONCE(sub->pos, head - size);
+        goto out;
+    }
+    n = min_t(u64, iov_iter_count(to), head - sub->pos);
+    ret = -EFAULT;
+    if (!scull_p_get(dev, scull_p_bpos(dev, sub->pos), NULL, to, (size_t) n))
+        goto out;
+    /* was any of it overwritten while we copied? */
+    smp_rmb();
+    head = READ_ONCE(dev->bresv);
+    if (head - sub->pos > size) {
+        iov_iter_revert(to, (size_t) n);
+        sub->overruns += head - size - sub->pos;
+        WRITE_ONCE(sub->pos, head - size);
+        ret = -EOVERFLOW;
+        goto out;
+    }
+    WRITE_ONCE(sub->pos, sub->pos + n);
+    ret = (ssize_t) n;
+    if (dev->bcast == SCULL_P_BCAST_BLOCK) {
+        scull_p_sub_tail(dev);
+        scull_p_pass_on(&dev->outq, scull_p_bspace(dev) > 0);
+    }
+    out:
+        mutex_unlock(&sub->lock);
+        return ret;
+}
+
+static unsigned int scull_p_bcast_poll(struct scull_pipe *dev, struct file *filp){
+    struct scull_p_sub *sub = scull_p_file(filp)->sub;
+    unsigned int mask = 0;
+
+    if (sub && READ_ONCE(sub->pos) != smp_load_acquire(&dev->bhead))
+        mask |= POLLIN | POLLRDNORM;
+    if (scull_p_bspace(dev))
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
+
+/* Bytes this reader lost since the last call, and start counting again */
+static long scull_p_bcast_overruns(struct scull_pipe *dev, struct file *filp){
+    struct scull_p_sub *sub = scull_p_file(filp)->sub;
+    long lost;
+
+    if (!sub)
+        return -EINVAL;
+    if (mutex_lock_interruptible(&sub->lock))
+        return -ERESTARTSYS;
+    lost = (long) min_t(u64, sub->overruns, LONG_MAX);
+    sub->overruns = 0;
+    mutex_unlock(&sub->lock);
+    return lost;
+}
+
+/****************** Direct handoff to a blocked reader ******************/
+/*
+ * A reader about to sleep on an empty ring pins the pages of its
+ * buffer and posts them in dev->handoff. The next writer claims the
+ * post with cmpxchg() and copies straight into those pages, so the
+ * data skips the ring: one copy instead of two. The reader lets go of
+ * the read side before it sleeps, so resize and release aren't held up,
+ * but a pending post still counts as a busy read side: other readers
+ * wait behind it (O_NONBLOCK ones get -EAGAIN), which keeps the order
+ * of the stream. The reader takes its post back if it is woken for
+ * anything else. A claimed post is always completed.
+ */
+#define SCULL_P_HANDOFF_PAGES 16
+#define SCULL_P_HANDOFF_DONE  1
+
+struct scull_p_handoff {
+    struct page *pages[SCULL_P_HANDOFF_PAGES];
+    size_t offset, len; /* of the buffer in pages[0], its length */
+    size_t done;        /* bytes copied in by the writer */
+    struct task_struct *task;
+    int state;
+};
+
+/* Writer side, owning the write side: 0 if there was no reader to serve */
+static ssize_t scull_p_handoff_give(struct scull_pipe *dev, struct iov_iter *from){
+    struct scull_p_handoff *h = READ_ONCE(dev->handoff);
+    struct task_struct *task;
+    size_t off, n, copied;
+    int i;
+
+    /* only on an empty ring, or the reader would get bytes out of order */
+    if (!h || READ_ONCE(dev->rp) != dev->wp || cmpxchg(&dev->handoff, h, NULL) != h)
+        return 0;
+    off = h->offset;
+    for (i = 0; h->done < h->len && iov_iter_count(from); i++) {
+        n = min3(PAGE_SIZE - off, h->len - h->done, iov_iter_count(from));
+        copied = copy_page_from_iter(h->pages[i], off, n, from);
+        h->done += copied;
+        if (copied < n)
+            break; /* fault */
+        off = 0;
+    }
+    copied = h->done;
+    /* h lives on the reader's stack: done with it after this */
+    task = get_task_struct(h->task);
+    smp_store_release(&h->state, SCULL_P_HANDOFF_DONE);
+    /* that reader, not whoever is first on inq */
+    wake_up_process(task);
+    put_task_struct(task);
+    return copied ? (ssize_t) copied : -EFAULT;
+}
+
+/*
+ * Reader side: wait on an empty ring with the buffer posted. Returns
+ * the bytes a writer handed over, or -EAGAIN to read from the ring.
+ */
+static ssize_t scull_p_handoff_take(struct scull_pipe *dev, struct file *filp, struct iov_iter *to){
+    struct scull_p_handoff h;
+    struct page **pages = h.pages;
+    ssize_t len;
+    int npages, err;
+
+    /* a spinning reader would sleep here instead */
+    if (!READ_ONCE(scull_p_handoff) || dev->lanes || READ_ONCE(dev->spin_us) ||
+        (filp->f_flags & O_NONBLOCK) || !user_backed_iter(to) ||
+        READ_ONCE(dev->rcvlowat) > 1 || READ_ONCE(dev->rp) != READ_ONCE(dev->wp))
+        return -EAGAIN;
+    if (scull_p_lock(dev, SCULL_P_READING))
+        return -ERESTARTSYS;
+    if (dev->rp != READ_ONCE(dev->wp) || READ_ONCE(dev->handoff)) {
+        scull_p_unlock(dev, SCULL_P_READING);
+        return -EAGAIN;
+    }
+    len = iov_iter_extract_pages(to, &pages, SCULL_P_HANDOFF_PAGES * PAGE_SIZE, SCULL_P_HANDOFF_PAGES,
+                                 0, &h.offset);
+    if (len <= 0) {
+        scull_p_unlock(dev, SCULL_P_READING);
+        return -EAGAIN;
+    }
+    npages = (int) DIV_ROUND_UP(h.offset + len, PAGE_SIZE);
+    h.len = (size_t) len;
+    h.done = 0;
+    h.task = current;
+    h.state = 0;
+    smp_store_release(&dev->handoff, &h);
+    /* the post keeps other readers out from here on */
+    scull_p_unlock(dev, SCULL_P_READING);
+
+    /* not exclusive: any data in the ring must get us out of here */
+    err = wait_event_interruptible(dev->inq, smp_load_acquire(&h.state) ||
+                                   READ_ONCE(dev->rp) != READ_ONCE(dev->wp));
+    if (cmpxchg(&dev->handoff, &h, NULL) != &h) {
+        /* a writer has it: let it finish, the bytes are ours either way */
+        wait_event(dev->inq, smp_load_acquire(&h.state));
+        err = 0;
+    }
+    unpin_user_pages_dirty_lock(h.pages, npages, h.done > 0);
+    iov_iter_revert(to, h.len - h.done);
+    /* readers that waited behind the post */
+    scull_p_pass_on(&dev->inq, scull_p_ring_ready(dev));
+    if (h.done) {
+        scull_p_wake_writers(dev);
+        return (ssize_t) h.done;
+    }
+    return err ? -ERESTARTSYS : -EAGAIN;
+}
+
+static ssize_t scull_p_read(struct file *filp, struct iov_iter *to) {
+    struct scull_pipe *dev = scull_p_dev(filp);
+    size_t count = iov_iter_count(to), done = 0, chunk, n;
+    ssize_t given;
+    char *rp, *wp;
+    int result;
+    if (!count)
+        return 0;
+    if (dev->ring)
+        return -EINVAL; /* the mapping is the only data path */
+    if (dev->nshards)
+        return scull_p_shard_read(dev, filp, to);
+    if (dev->bcast)
+        return scull_p_bcast_read(dev, filp, to);
+    if (dev->records) {
+        /* one message per read() */
+        result = scull_p_msg_recv(dev, filp, to, NULL, 1, &done);
+        return result < 0 ? result : (ssize_t) done;
+    }
+    given = scull_p_handoff_take(dev, filp, to);
+    if (given != -EAGAIN)
+        return given;
+    result = scull_p_getreaddata(dev, filp);
+    if (result)
+        return result;
+    /* higher lanes first */
+    given = scull_p_lane_read(dev, to);
+    if (given) {
+        scull_p_unlock(dev, SCULL_P_READING);
+        return given;
+    }
+    rp = dev->rp;
+    /* pairs with the release in scull_p_write_lane: the bytes before wp are there */
+    wp = smp_load_acquire(&dev->wp);
+    /* Copy both segments of wrapped data: rp to the end, then from the start */
+    while (done < count && rp != wp) {
+        if (wp > rp)
+            chunk = min(count - done, (size_t) (wp - rp));
+        else
+            chunk = min(count - done, (size_t) (dev->end - rp));
+        n = copy_to_iter(rp, chunk, to);
+        rp += n;
+        /* Reset reader pointer if its at the last index of the buffer */
+        if (rp == dev->end)
+            rp = dev->buffer;
+        done += n;
+        if (n < chunk)
+            break; /* fault */
+    }
+    /* the writer may reuse the space only once the bytes are copied out */
+    smp_store_release(&dev->rp, rp);
+    scull_p_unlock(dev, SCULL_P_READING);
+    if (!done)
+        return -EFAULT;
+
+    /* finally, awake the next writer, and the next reader if something is left */
+    scull_p_wake_writers(dev);
+    scull_p_pass_on(&dev->inq, scull_p_readable(dev));
+    return (ssize_t) done;
+
+}
+
+/* Wait for need bytes of space for writing; caller must own the write side. On
+ * error the write side will be released before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp, int need) {
+    bool slept = false;
+    u64 start, waited;
+
+    while(spacefree(dev) < need){ /* full */
         /* defining the wait task */
         DEFINE_WAIT(wait);
 
-        up(&dev->sem);
+        scull_p_unlock(dev, SCULL_P_WRITING);
+        /* the ring may have been shrunk under a waiting message */
+        if (need > READ_ONCE(dev->buffersize) - 1)
+            return -EMSGSIZE;
         /* For non-block tell the user-space access again */
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
-        /* set the wait scheduler flag to TASK_INTERRUPTABLE & add to the wait queue */
-        prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-        if (spacefree(dev) == 0)
-            /* Yield the current thread to the processor */
-            schedule();
-        /* Remove the current task from the wait queu and set back to TASK_RUNNING */
-        finish_wait(&dev->outq, &wait);
+        start = ktime_get_ns();
+        if (!scull_p_spin(dev, spacefree(dev) >= need)) {
+            /*
+             * set the wait scheduler flag to TASK_INTERRUPTABLE & queue up, first come first woken.
+             * Writers are woken once sndlowat bytes are free: one that needs more could take
+             * the single wakeup, still not fit and sleep again while a smaller writer behind
+             * it would have. Those wait with the herd and leave the queue its order.
+             */
+            if (need > READ_ONCE(dev->sndlowat))
+                prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
+            else
+                prepare_to_wait_exclusive(&dev->outq, &wait, TASK_INTERRUPTIBLE);
+            if (spacefree(dev) < need) {
+                /* Yield the current thread to the processor */
+                schedule();
+                this_cpu_inc(dev->stats->woken[SCULL_P_WRITING]);
+                slept = true;
+            }
+            /* Remove the current task from the wait queu and set back to TASK_RUNNING */
+            finish_wait(&dev->outq, &wait);
+        }
+        waited = ktime_get_ns() - start;
+        scull_p_blocked(dev, SCULL_P_WRITING, waited);
+        if (READ_ONCE(dev->spin_us))
+            scull_p_spin_tune(dev, waited);
         /* ensure that we are not woken up by another signal */
         if (signal_pending(current)){
+            scull_p_wake_writers(dev); /* the wakeup may have been meant for us: pass it on */
             return -ERESTARTSYS;
         }
-        if (down_interruptible(&dev->sem)){
+        if (scull_p_lock(dev, SCULL_P_WRITING)){
             return -ERESTARTSYS;
         }
     }
+    if (slept)
+        this_cpu_inc(dev->stats->useful[SCULL_P_WRITING]);
     return 0;
 }
 
 
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-    struct scull_pipe *dev = filp->private_data;
+static ssize_t scull_p_write_lane(struct file *filp, struct iov_iter *from, int lane) {
+    struct scull_pipe *dev = scull_p_dev(filp);
+    size_t count = iov_iter_count(from), done = 0, chunk, n;
+    char *rp, *wp;
     int result;
 
-    if (down_interruptible(&dev->sem))
+    if (!count)
+        return 0;
+    if (lane)
+        return dev->lanes ? scull_p_lane_write(dev, filp, lane, from) : -EINVAL;
+    if (dev->ring)
+        return -EINVAL;
+    if (dev->nshards)
+        return scull_p_shard_write(dev, filp, from);
+    if (dev->bcast)
+        return scull_p_bcast_write(dev, filp, from);
+    if (dev->records)
+        return scull_p_msg_write(dev, filp, from);
+    if (scull_p_lock(dev, SCULL_P_WRITING))
         return -ERESTARTSYS;
+    if (READ_ONCE(dev->handoff)) {
+        ssize_t given = scull_p_handoff_give(dev, from);
+        if (given) {
+            scull_p_unlock(dev, SCULL_P_WRITING);
+            return given;
+        }
+    }
 
     // Make sure there is no space to write
-    result = scull_getwritespace(dev, filp);
+    result = scull_getwritespace(dev, filp, 1);
     if (result)
-        return result; /* scull_getwritespace called up(&dev->sem) */
-    // ok, space is there, accept something
-    count = min(count, (size_t) spacefree(dev));
-    if (dev->wp >= dev->rp)
-        count = min(count, dev->end - dev->wp); // to end-of-buff
-    else
-        count = min(count, dev->rp - dev->wp - 1);
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count)) {
-        up(&dev->sem);
-        return -EFAULT;
+        return result; /* scull_getwritespace released the write side */
+    wp = dev->wp;
+    /* pairs with the release in scull_p_read: the reader is done with the space */
+    rp = smp_load_acquire(&dev->rp);
+    // ok, space is there, accept as much as fits: up to the end, then from the start
+    while (done < count && scull_p_space(dev, rp, wp)) {
+        chunk = min(count - done, (size_t) scull_p_space(dev, rp, wp));
+        if (wp >= rp)
+            chunk = min(chunk, (size_t) (dev->end - wp)); // to end-of-buff
+        PDEBUG("Going to accept %li bytes to %p\n", (long)chunk, wp);
+        n = copy_from_iter(wp, chunk, from);
+        wp += n;
+        if (wp == dev->end)
+            wp = dev->buffer; // wrapped
+        done += n;
+        if (n < chunk)
+            break; /* fault */
     }
-    dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->buffer; // wrapped
-    up(&dev->sem);
+    /* publish the bytes to the reader */
+    smp_store_release(&dev->wp, wp);
+    scull_p_unlock(dev, SCULL_P_WRITING);
+    if (!done)
+        return -EFAULT;
 
-    wake_up_interruptible(&dev->inq); // blocked in read() and select()
-    if (dev->async_queue)
-        /* and signal asynchronous readers if there are any registered with fnctl(F_ASYNC) */
-        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-    PDEBUG("%s did write %li bytes\n",current->comm, (long)count);
-    return count;
+    scull_p_pass_on(&dev->outq, scull_p_writable(dev));
+    scull_p_wake_readers(dev);
+    PDEBUG("%s did write %li bytes\n",current->comm, (long)done);
+    return (ssize_t) done;
+
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    return scull_p_account(scull_p_dev(iocb->ki_filp), SCULL_P_READING, scull_p_read(iocb->ki_filp, to));
+}
 
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    return scull_p_account(scull_p_dev(iocb->ki_filp), SCULL_P_WRITING,
+                           scull_p_write_lane(iocb->ki_filp, from, scull_p_file(iocb->ki_filp)->lane));
 }
 
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait){
 
-    struct scull_pipe *dev = filp->private_data;
-    unsigned int mask = 0;
+    struct scull_pipe *dev = scull_p_dev(filp);
+    unsigned int mask = 0, seq;
     /*
      * The buffer is circular;
      * if wp == rp + 1: full
      * if wp == rp: empty
+     *
+     * No lock here: the mode and the ring can't change while the file
+     * is open, except for a resize, which the seqcount catches. The
+     * entries go on the wait queues first; a writer publishes wp before
+     * taking the queue lock to wake us, so either we see its data here
+     * or it sees our entry.
      */
-    down(&dev->sem);
     /* poll_wait does not put the process to sleep; it only registers the process on the wait queue */
     poll_wait(filp, &dev->inq, wait);
     poll_wait(filp, &dev->outq, wait);
-    if (dev->rp != dev->wp){
-        mask |= POLLIN | POLLRDNORM;
-    }
-    if (spacefree(dev)){
-        mask |= POLLOUT | POLLWRNORM;
+    if (dev->ring) {
+        mask = scull_p_ring_poll(dev);
+    } else if (dev->bcast) {
+        mask = scull_p_bcast_poll(dev, filp);
+    } else if (dev->nshards) {
+        if (scull_p_shards_readable(dev))
+            mask |= POLLIN | POLLRDNORM;
+        if (scull_p_shards_writable(dev))
+            mask |= POLLOUT | POLLWRNORM;
+    } else {
+        do {
+            seq = read_seqcount_begin(&dev->resize_seq);
+            mask = 0;
+            if (scull_p_readable(dev)){
+                mask |= POLLIN | POLLRDNORM;
+            }
+            if (scull_p_writable(dev)){
+                mask |= POLLOUT | POLLWRNORM;
+            }
+        } while (read_seqcount_retry(&dev->resize_seq, seq));
     }
-    up(&dev->sem);
     return mask;
 }
 static int scull_p_fasync(int fd, struct file *filp, int mode){
     /* registers or de-registers a process from async notifications
     called when user app sets F_ASYNC flag using fcntl */
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_pipe *dev = scull_p_dev(filp);
     return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
 
+/*
+ * Resize the ring of an open pipe, keeping the bytes in flight, like
+ * F_SETPIPE_SZ. Owning both sides stops the reader and the writer for
+ * the copy; the size is also kept for the next time the pipe is set up.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long size){
+    size_t bufsize = size;
+    char *buffer;
+    int used;
+    long ret = scull_p_size_check(size);
+
+    if (ret)
+        return ret;
+    buffer = scull_p_ring_alloc(size);
+    if (!buffer)
+        return -ENOMEM;
+    if (down_interruptible(&dev->sem)) {
+        scull_p_ring_free(buffer, bufsize);
+        return -ERESTARTSYS;
+    }
+    if (dev->nshards || dev->ring || dev->bcast) {
+        ret = -EINVAL; /* shards and mapped rings are sized when the pipe is set up */
+        goto out;
+    }
+    if (scull_p_lock(dev, SCULL_P_READING)) {
+        ret = -ERESTARTSYS;
+        goto out;
+    }
+    if (scull_p_lock(dev, SCULL_P_WRITING)) {
+        scull_p_unlock(dev, SCULL_P_READING);
+        ret = -ERESTARTSYS;
+        goto out;
+    }
+    used = dev->buffersize - 1 - spacefree(dev);
+    if (used > (int) size - 1) {
+        ret = -EBUSY; /* the data in flight wouldn't fit */
+    } else {
+        /* move the data to the start of the new ring, unwrapped */
+        scull_p_get(dev, dev->rp, buffer, NULL, used);
+        /* poll() samples the indices without locks: let it see old or new, not a mix */
+        preempt_disable();
+        write_seqcount_begin(&dev->resize_seq);
+        swap(dev->buffer, buffer);
+        bufsize = (size_t) dev->buffersize;
+        dev->buffersize = (int) size;
+        dev->end = dev->buffer + size;
+        dev->rp = dev->buffer;
+        dev->wp = dev->buffer + used;
+        write_seqcount_end(&dev->resize_seq);
+        preempt_enable();
+        dev->buffer_cfg = (int) size;
+        ret = (long) size;
+    }
+    scull_p_unlock(dev, SCULL_P_WRITING);
+    scull_p_unlock(dev, SCULL_P_READING);
+    out:
+        up(&dev->sem);
+        scull_p_ring_free(buffer, bufsize); /* the old ring, or the unused new one */
+        if (ret > 0) {
+            /* writers may fit now, or learn their message no longer does */
+            wake_up_interruptible_all(&dev->outq);
+            /* and a smaller ring lowers the rcvlowat cap readers sleep on */
+            wake_up_interruptible_all(&dev->inq);
+        }
+        return ret;
+}
+
+static long scull_p_ioctl_recv(struct scull_pipe *dev, struct file *filp, struct scull_p_msgs __user *umsgs){
+    struct scull_p_msgs msgs;
+    struct iov_iter iter;
+    size_t bytes;
+    int n;
+
+    if (!dev->records)
+        return -EINVAL;
+    if (copy_from_user(&msgs, umsgs, sizeof(msgs)))
+        return -EFAULT;
+    if (!msgs.max)
+        return -EINVAL;
+    n = import_ubuf(ITER_DEST, (void __user *) (uintptr_t) msgs.buf, msgs.size, &iter);
+    if (n)
+        return n;
+    n = scull_p_msg_recv(dev, filp, &iter, (u32 __user *) (uintptr_t) msgs.lens, msgs.max, &bytes);
+    if (n < 0)
+        return scull_p_account(dev, SCULL_P_READING, n);
+    scull_p_account(dev, SCULL_P_READING, (ssize_t) bytes);
+    msgs.count = (u32) n;
+    msgs.bytes = (u32) bytes;
+    if (copy_to_user(umsgs, &msgs, sizeof(msgs)))
+        return -EFAULT;
+    return n;
+}
+
+static long scull_p_ioctl_wlane(struct file *filp, struct scull_p_lane_msg __user *umsg){
+    struct scull_p_lane_msg msg;
+    struct iov_iter iter;
+    int err;
+
+    if (copy_from_user(&msg, umsg, sizeof(msg)))
+        return -EFAULT;
+    if (msg.lane >= SCULL_P_LANES)
+        return -EINVAL;
+    err = import_ubuf(ITER_SOURCE, (void __user *) (uintptr_t) msg.buf, msg.len, &iter);
+    if (err)
+        return err;
+    return scull_p_account(scull_p_dev(filp), SCULL_P_WRITING, scull_p_write_lane(filp, &iter, (int) msg.lane));
+}
+
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    struct scull_pipe *dev = scull_p_dev(filp);
+    long ret = 0;
+    switch (cmd) {
+        case SCULL_P_IOCTRCVLOWAT: // Tell: bytes queued before readers wake
+        case SCULL_P_IOCTSNDLOWAT: // Tell: bytes free before writers wake
+            if (arg < 1 || arg > SCULL_P_MAX_BUFFER)
+                return -EINVAL;
+            if (cmd == SCULL_P_IOCTRCVLOWAT)
+                WRITE_ONCE(dev->rcvlowat, (int) arg);
+            else
+                WRITE_ONCE(dev->sndlowat, (int) arg);
+            /* a lower mark may already be met, for any of the waiters */
+            wake_up_interruptible_all(&dev->inq);
+            wake_up_interruptible_all(&dev->outq);
+            return 0;
+        case SCULL_P_IOCTSPIN: // Tell: busy-poll budget in microseconds, 0: sleep right away
+            if (arg > SCULL_P_MAX_SPIN)
+                return -EINVAL;
+            WRITE_ONCE(dev->spin_us, (int) arg);
+            WRITE_ONCE(dev->spin_ns, 0); /* retune from scratch */
+            return 0;
+        case SCULL_P_IOCTLANES: // Tell: priority lanes from the next open of an idle pipe
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && (dev->shard_cfg || dev->record_cfg || dev->mmap_cfg || dev->bcast_cfg))
+                ret = -EINVAL;
+            else
+                dev->lanes_cfg = !!arg;
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCTLANE: // Tell: lane of this file's write()s
+            if (arg >= SCULL_P_LANES)
+                return -EINVAL;
+            scull_p_file(filp)->lane = (int) arg;
+            return 0;
+        case SCULL_P_IOCWLANE: // one write on a given lane
+            return scull_p_ioctl_wlane(filp, (struct scull_p_lane_msg __user *) arg);
+        case SCULL_P_IOCTBCAST: // Tell: broadcast policy, or 0 for a plain pipe
+            if (arg > SCULL_P_BCAST_DROP)
+                return -EINVAL;
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && (dev->shard_cfg || dev->record_cfg || dev->mmap_cfg || dev->lanes_cfg)) {
+                ret = -EINVAL;
+            } else {
+                dev->bcast_cfg = (int) arg;
+                /* a broadcast pipe may switch policy on the fly */
+                if (arg && READ_ONCE(dev->bcast)) {
+                    WRITE_ONCE(dev->bcast, (int) arg);
+                    scull_p_sub_tail(dev); /* not kept up to date while dropping */
+                    wake_up_interruptible_all(&dev->outq);
+                }
+            }
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCQOVERRUN: // Query: bytes this reader missed in drop mode
+            return scull_p_bcast_overruns(dev, filp);
+        case SCULL_P_IOCRING: // doorbell of a mapped ring
+            return scull_p_ring_doorbell(dev, arg);
+        case SCULL_P_IOCTMMAP: // Tell: mapped ring from the next open of an idle pipe
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && (dev->shard_cfg || dev->record_cfg || dev->bcast_cfg || dev->lanes_cfg))
+                ret = -EINVAL;
+            else
+                dev->mmap_cfg = !!arg;
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCTRECORD: // Tell: records (1) or a byte stream (0) from the next open of an idle pipe
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && (dev->shard_cfg || dev->mmap_cfg || dev->bcast_cfg || dev->lanes_cfg))
+                ret = -EINVAL; /* shards already keep each write whole */
+            else
+                dev->record_cfg = !!arg;
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCTSTAMP: // Tell: latency stamps from the next open of an idle record or sharded pipe
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && !dev->record_cfg && !dev->shard_cfg)
+                ret = -EINVAL;
+            else
+                dev->stamp_cfg = !!arg;
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCGLAT: // Get: delay of the last stamped message this file read
+            if (!dev->stamps)
+                return -EINVAL;
+            return put_user(scull_p_file(filp)->lat, (__u64 __user *) arg);
+        case SCULL_P_IOCRECV: // batched read of whole records
+            return scull_p_ioctl_recv(dev, filp, (struct scull_p_msgs __user *) arg);
+        case SCULL_P_IOCTBUF: // Tell: resize this pipe's ring now, returns the size
+            return scull_p_resize(dev, arg);
+        case SCULL_P_IOCQBUF: // Query: this pipe's ring size
+            return READ_ONCE(dev->buffersize);
+        case SCULL_P_IOCTSHARDS: // Tell: shards from the next open of an idle pipe
+            if ((int) arg < SCULL_P_SHARDS_PER_CPU || (int) arg > SCULL_P_MAX_SHARDS)
+                return -EINVAL;
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            if (arg && (dev->record_cfg || dev->mmap_cfg || dev->bcast_cfg || dev->lanes_cfg))
+                ret = -EINVAL;
+            else
+                dev->shard_cfg = (int) arg;
+            up(&dev->sem);
+            return ret;
+        case SCULL_P_IOCTMERGE: // Tell: arg is the merge order
+            if (arg != SCULL_P_MERGE_RR && arg != SCULL_P_MERGE_STAMP)
+                return -EINVAL;
+            WRITE_ONCE(dev->merge, (int) arg);
+            return 0;
+        default:
+            return scull_ioctl(filp, cmd, arg);
+    }
+}
+
+/*
+ * /proc/scullpipe: ring use per device, and per shard in sharded mode
+ */
+static int scull_p_proc_show(struct seq_file *s, void *v){
+    int i, j;
+    for (i = 0; i < scull_nr_devs; i++) {
+        struct scull_pipe *p = &scull_devices[i];
+        if (down_interruptible(&p->sem))
+            return -ERESTARTSYS;
+        seq_printf(s, "scullpipe%i: %s readers %i writers %i lowat %i/%i", i,
+                   p->records ? "records" : "stream", p->nreaders, p->nwriters, p->rcvlowat, p->sndlowat);
+        if (p->spin_us)
+            seq_printf(s, " spin %u/%i us", READ_ONCE(p->spin_ns) / NSEC_PER_USEC, p->spin_us);
+        if (p->bcast)
+            seq_printf(s, " broadcast %s subscribers %i head %llu tail %llu",
+                       p->bcast == SCULL_P_BCAST_DROP ? "drop" : "block", p->nsubs,
+                       (unsigned long long) p->bhead, (unsigned long long) p->btail);
+        else if (p->ring)
+            seq_printf(s, " mapped used %u/%u bytes", READ_ONCE(p->ring->head) - READ_ONCE(p->ring->tail),
+                       p->ring_size);
+        else if (p->buffer && !p->nshards)
+            seq_printf(s, " used %i/%i bytes", p->buffersize - 1 - spacefree(p), p->buffersize - 1);
+        seq_putc(s, '\n');
+        for (j = 0; p->lanes && j < SCULL_P_LANES - 1; j++)
+            seq_printf(s, "  lane%i: %u/%u bytes\n", j + 1, scull_p_shard_used(p->lanes + j),
+                       p->lanes[j].mask + 1);
+        for (j = 0; j < p->nshards; j++)
+            seq_printf(s, "  shard%i: %u/%u bytes\n", j, scull_p_shard_used(p->shards + j),
+                       p->shards[j].mask + 1);
+        up(&p->sem);
+    }
+    seq_printf(s, "pool: %lu rings %lu bytes\n", READ_ONCE(scull_p_pool_count), READ_ONCE(scull_p_pool_bytes));
+    return 0;
+}
+
+/*
+ * /proc/scullpipe_stats: the counters of each device since load. Blocked
+ * time and latency histograms are keyed by their lower bound in
+ * microseconds.
+ */
+static void scull_p_hist_show(struct seq_file *s, const u64 *hist){
+    int j;
+    for (j = 0; j < SCULL_P_HIST_BUCKETS; j++)
+        if (hist[j])
+            seq_printf(s, " %s%llu:%llu", j ? "" : "<", j ? 1ULL << (j - 1) : 1ULL, hist[j]);
+    seq_putc(s, '\n');
+}
+
+static int scull_p_stats_show(struct seq_file *s, void *v){
+    static const char * const side[] = { "read", "write" };
+    struct scull_p_stats sum;
+    u64 *total = (u64 *) &sum, *c;
+    int i, j, k, cpu;
+
+    for (i = 0; i < scull_nr_devs; i++) {
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu) {
+            c = (u64 *) per_cpu_ptr(scull_devices[i].stats, cpu);
+            for (j = 0; j < (int) (sizeof(sum) / sizeof(u64)); j++)
+                total[j] += c[j];
+        }
+        seq_printf(s, "scullpipe%i: in %llu out %llu bytes sigio %llu\n", i, sum.bytes[SCULL_P_WRITING],
+                   sum.bytes[SCULL_P_READING], sum.sigio);
+        for (k = SCULL_P_READING; k <= SCULL_P_WRITING; k++) {
+            seq_printf(s, "  %s: eagain %llu waits %llu blocked %llu us woken %llu useful %llu\n  %s blocked us:",
+                       side[k], sum.eagain[k], sum.waits[k], sum.blocked_ns[k] / NSEC_PER_USEC, sum.woken[k],
+                       sum.useful[k], side[k]);
+            scull_p_hist_show(s, sum.blocked[k]);
+        }
+        if (scull_devices[i].stamp_cfg) {
+            seq_puts(s, "  latency us:");
+            scull_p_hist_show(s, sum.latency);
+        }
+        seq_puts(s, "  occupancy %:");
+        for (j = 0; j < SCULL_P_OCC_BUCKETS; j++)
+            seq_printf(s, " %i-%i:%llu", j * 100 / SCULL_P_OCC_BUCKETS, (j + 1) * 100 / SCULL_P_OCC_BUCKETS,
+                       sum.occupancy[j]);
+        seq_putc(s, '\n');
+    }
+    return 0;
+}
+
 struct file_operations scull_p_fops = {
         .owner = THIS_MODULE,
         .llseek = no_llseek,
-        .read = scull_p_read,
-        .write = scull_p_write,
+        .read_iter = scull_p_read_iter,
+        .write_iter = scull_p_write_iter,
+        /* splice moves pipe pages through read_iter/write_iter, in the kernel */
+        .splice_read = copy_splice_read,
+        .splice_write = iter_file_splice_write,
         .poll = scull_p_poll,
-        .unlocked_ioctl = scull_ioctl,
+        .unlocked_ioctl = scull_p_ioctl,
+        .mmap = scull_p_mmap,
         .open = scull_p_open,
         .release = scull_p_release,
         .fasync = scull_p_fasync,
@@ -235,11 +1872,20 @@ void scull_p_cleanup(void)
     if (!scull_devices)
         return; /* nothing else to release */
 
+    proc_remove(scull_p_proc);
+    proc_remove(scull_p_stats_proc);
     for (i = 0; i < scull_nr_devs; i++) {
         cdev_del(&scull_devices[i].cdev);
-        kfree(scull_devices[i].buffer);
+        scull_p_ring_free(scull_devices[i].buffer, (size_t) scull_devices[i].buffersize);
+        scull_p_shards_free(scull_devices + i);
+        scull_p_lanes_free(scull_devices + i);
+        vfree(scull_devices[i].ring);
+        free_percpu(scull_devices[i].stats);
     }
     kfree(scull_devices);
+    /* no more scans once it is gone, then empty the pool */
+    shrinker_free(scull_p_shrinker);
+    scull_p_pool_drain(ULONG_MAX);
     unregister_chrdev_region(devno, (unsigned int) scull_nr_devs);
     scull_devices = NULL; /* pedantic */
 }
@@ -265,20 +1911,46 @@ int __init scull_p_init(void){
         goto fail;  /* Make this more graceful */
     }
     memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_pipe));
+    /* the counters, one per-CPU block per device: a single one would outgrow the allocator */
+    for (i = 0; i < scull_nr_devs; i++) {
+        scull_devices[i].stats = alloc_percpu(struct scull_p_stats);
+        if (!scull_devices[i].stats) {
+            while (i--)
+                free_percpu(scull_devices[i].stats);
+            kfree(scull_devices);
+            scull_devices = NULL;
+            result = -ENOMEM;
+            goto fail;
+        }
+    }
     /* Initialize each device. */
 
     for (i = 0; i < scull_nr_devs; i++){
         init_waitqueue_head(&scull_devices[i].inq);
         init_waitqueue_head(&scull_devices[i].outq);
         sema_init(&scull_devices[i].sem, 1);
+        seqcount_init(&scull_devices[i].resize_seq);
+        INIT_LIST_HEAD(&scull_devices[i].subs);
+        spin_lock_init(&scull_devices[i].sub_lock);
+        scull_devices[i].shard_cfg = scull_p_shards;
+        scull_devices[i].rcvlowat = scull_devices[i].sndlowat = 1;
         // init the cdev
         cdev_init(&scull_devices[i].cdev, &scull_p_fops);
         scull_devices[i].cdev.owner = THIS_MODULE;
         // gives access to container_of to dev
-        err = cdev_add(&scull_devices[i].cdev, i, 1);
+        err = cdev_add(&scull_devices[i].cdev, MKDEV(scull_major, scull_minor + i), 1);
         if(err)
             printk(KERN_NOTICE "Error %d adding scullpipe%d", err, i);
     }
+    scull_p_proc = proc_create_single("scullpipe", 0, NULL, scull_p_proc_show);
+    scull_p_stats_proc = proc_create_single("scullpipe_stats", 0, NULL, scull_p_stats_show);
+    /* without a shrinker the rings are not pooled at all */
+    scull_p_shrinker = shrinker_alloc(0, "scull_pipe-pool");
+    if (scull_p_shrinker) {
+        scull_p_shrinker->count_objects = scull_p_pool_count_objects;
+        scull_p_shrinker->scan_objects = scull_p_pool_scan_objects;
+        shrinker_register(scull_p_shrinker);
+    }
     return 0;
     fail:
         scull_p_cleanup();
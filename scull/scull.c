@@ -11,6 +11,12 @@
 #include <asm-generic/ioctl.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/bitmap.h>
+#include <linux/nodemask.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/list.h>
 #include "scull.h"
 
 
@@ -23,6 +29,100 @@ int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =  SCULL_QSET;
 int scull_p_buffer = SCULL_P_BUFFER;	/* buffer size */
+int scull_numa_policy = SCULL_NUMA_LOCAL;
+int scull_numa_node = 0;	/* for SCULL_NUMA_BIND */
+int scull_large_order = SCULL_LARGE_ORDER;
+
+static void scull_kv_clear(struct scull_kv *kv);
+
+int scull_numa_valid(int policy, int node){
+    switch (policy) {
+        case SCULL_NUMA_LOCAL:
+        case SCULL_NUMA_INTERLEAVE:
+            return 1;
+        case SCULL_NUMA_BIND:
+            return node >= 0 && node < nr_node_ids && node_online(node);
+        default:
+            return 0;
+    }
+}
+
+/* A pipe ring size, as SCULL_P_IOCTBUF and SCULL_P_IOCTSIZE accept it */
+long scull_p_size_check(unsigned long size){
+    if (size < SCULL_P_MIN_BUFFER || size > SCULL_P_MAX_BUFFER)
+        return -EINVAL;
+    if (size > SCULL_P_MAX_USER_BUFFER && !capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+    return 0;
+}
+
+/* Pick the node for the next quantum according to the device policy */
+static int scull_quantum_node(struct scull_dev *dev){
+    switch (dev->numa_policy) {
+        case SCULL_NUMA_INTERLEAVE:
+            dev->numa_next = next_online_node(dev->numa_next);
+            if (dev->numa_next >= MAX_NUMNODES)
+                dev->numa_next = first_online_node;
+            return dev->numa_next;
+        case SCULL_NUMA_BIND:
+            return dev->numa_node;
+        default:
+            return numa_node_id();
+    }
+}
+
+static int scull_quantum_nid(void *q){
+    if (is_vmalloc_addr(q))
+        return page_to_nid(vmalloc_to_page(q));
+    return page_to_nid(virt_to_page(q));
+}
+
+static void *scull_alloc_quantum(struct scull_dev *dev){
+    int node = scull_quantum_node(dev);
+    void *q;
+
+    /*
+     * Large quanta: kvmalloc tries one high-order folio without retrying
+     * or warning, and falls back to vmalloc'ed order-0 pages when memory
+     * is too fragmented.
+     */
+    if (dev->large_order)
+        q = kvmalloc_node(dev->quantum, GFP_KERNEL, node);
+    else
+        q = kmalloc_node(dev->quantum, GFP_KERNEL, node);
+    if (!q)
+        return NULL;
+    if (is_vmalloc_addr(q))
+        dev->vmalloc_quanta++;
+    /* account the node we really got, the allocator may have fallen back */
+    if (dev->node_quanta)
+        dev->node_quanta[scull_quantum_nid(q)]++;
+    return q;
+}
+
+static void scull_free_quantum(struct scull_dev *dev, void *q){
+    if (is_vmalloc_addr(q))
+        dev->vmalloc_quanta--;
+    if (dev->node_quanta)
+        dev->node_quanta[scull_quantum_nid(q)]--;
+    kvfree(q);
+}
+
+/**
+ * scull_set_large - switch a device between byte and large quanta
+ * @dev:   an empty scull_device, semaphore held
+ * @order: page order of the new quanta, 0 for scull_quantum bytes
+ */
+int scull_set_large(struct scull_dev *dev, int order){
+    if (order < 0 || order > SCULL_LARGE_MAX_ORDER)
+        return -EINVAL;
+    /* the layout of stored data depends on the quantum */
+    if (dev->data)
+        return -EBUSY;
+    dev->large_order = order;
+    dev->quantum = order ? (int) (PAGE_SIZE << order) : scull_quantum;
+    return 0;
+}
 
 /**
  * scull_trim - cleans up the memory space for a fresh write
@@ -38,13 +138,19 @@ int scull_trim(struct scull_dev *dev){
         if (dptr->data){
             for (i=0; i < qset; i++)
                 if (dptr->data[i])
-                    kfree(dptr->data[i]);
+                    scull_free_quantum(dev, dptr->data[i]);
             kfree(dptr->data);
             dptr->data = NULL;
         }
+        bitmap_free(dptr->dirty);
         next = dptr->next;
         kfree(dptr);
     }
+    /* the records are gone, keyed record mode stays on */
+    if (dev->kv)
+        scull_kv_clear(dev->kv);
+    /* whatever a backup holds is stale now */
+    dev->generation++;
     dev->size = 0;
     dev->quantum = quantum;
     dev->qset = qset;
@@ -75,12 +181,62 @@ struct scull_qset * scull_follow(struct scull_dev *dev, int item) {
     return dptr;
 }
 
+/**
+ * scull_quantum_at - find the byte at a device position
+ * @dev:   a scull_device, semaphore held
+ * @pos:   position in the device
+ * @write: allocate what is missing and mark the quantum dirty
+ * @avail: set to the bytes left in the quantum from @pos
+ *
+ * Returns NULL for a hole when reading, or when an allocation fails.
+ */
+static char *scull_quantum_at(struct scull_dev *dev, loff_t pos, int write, size_t *avail){
+    struct scull_qset *dptr;
+    int qset = dev->qset, quantum = dev->quantum;
+    long itemsize = (long) qset * quantum; /* large quanta overflow an int */
+    int item, s_pos, q_pos;
+    long rest;
+
+    // find the list items, qset index, & offset in the quantum
+    item = (int) (((long) pos) / itemsize);
+    rest = ((long) pos) % itemsize;
+    s_pos = (int) (rest / quantum), q_pos = (int) (rest % quantum);
+
+    // follow the list up to the right position
+    dptr = scull_follow(dev, item);
+    if (!dptr)
+        return NULL;
+    if (!write) {
+        if (!dptr->data || !dptr->data[s_pos])
+            return NULL;
+        goto found;
+    }
+    if (!dptr->data){
+        dptr->data = (void **) kmalloc(qset * sizeof(char *), GFP_KERNEL);
+        if (!dptr->data)
+            return NULL;
+        memset(dptr->data, 0, qset * sizeof(char *));
+    }
+    if (!dptr->dirty){
+        dptr->dirty = bitmap_zalloc(qset, GFP_KERNEL);
+        if (!dptr->dirty)
+            return NULL;
+    }
+    if (!dptr->data[s_pos]){
+        dptr->data[s_pos] = scull_alloc_quantum(dev);
+        if (!dptr->data[s_pos])
+            return NULL;
+    }
+    __set_bit(s_pos, dptr->dirty);
+    found:
+        *avail = (size_t) (quantum - q_pos);
+        return (char *) dptr->data[s_pos] + q_pos;
+}
+
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos){
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset * dptr;
-    int qset = dev->qset, quantum = dev->quantum;
-    int itemsize = qset * quantum;
-    int item, s_pos, q_pos, rest;
+    size_t avail;
+    char *p;
     ssize_t retval = 0;
 
     if (down_interruptible(&dev->sem)){
@@ -92,18 +248,13 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_
     if (*f_pos + count > dev -> size){
        count = dev->size - * f_pos;
     }
-    // find the list items, qset index, & offset in the quantum
-    item = (int) (((long) *f_pos) / itemsize);
-    rest = (int) (((long) *f_pos) % itemsize);
-    s_pos = rest / quantum, q_pos = rest % quantum;
-
-    dptr = scull_follow(dev, item);
-    if (!dptr || !dptr->data || !dptr->data[s_pos])
+    p = scull_quantum_at(dev, *f_pos, 0, &avail);
+    if (!p)
         goto out;
     // read only up to the end of the quantum
-    if (count > quantum - q_pos)
-        count = (size_t) (quantum - q_pos);
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+    if (count > avail)
+        count = avail;
+    if (copy_to_user(buf, p, count)) {
         retval = -EFAULT;
         goto out;
     }
@@ -118,42 +269,28 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_
 
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int qset = dev->qset, quantum = dev->quantum;
-    int itemsize = qset * quantum;
-    int item, s_pos, q_pos, rest;
+    size_t avail;
+    char *p;
     ssize_t retval = -ENOMEM;
 
 
     if (down_interruptible(&dev->sem)) {
         return -ERESTARTSYS;
     }
-
-    // find the list items, qset index, & offset in the quantum
-    item = (int) (((long) *f_pos) / itemsize);
-    rest = (int) (((long) *f_pos) % itemsize);
-    s_pos = rest / quantum, q_pos = rest % quantum;
-
-    // follow the list up to the right position
-    dptr = scull_follow(dev, item);
-    if (!dptr)
+    // the record index points into the data, only the ioctls may change it
+    if (dev->kv) {
+        retval = -EBUSY;
         goto out;
-    if (!dptr->data){
-        dptr->data = (void **) kmalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0, qset * sizeof(char *));
-    }
-    if (!dptr->data[s_pos]){
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
     }
+
+    p = scull_quantum_at(dev, *f_pos, 1, &avail);
+    if (!p)
+        goto out;
     // write only up to the end of this quantum
-    if (count > quantum - q_pos)
-        count = (size_t) (quantum - q_pos);
+    if (count > avail)
+        count = avail;
 
-    if (copy_to_user(dptr->data[s_pos] + q_pos, buf, count)){
+    if (copy_from_user(p, buf, count)){
         retval = -EFAULT;
         goto out;
     }
@@ -166,9 +303,364 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, lof
         up(&dev->sem);
         return retval;
 }
-long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+
+/*
+ * Keyed record mode: a chained hash over the records appended to the
+ * device. Each entry keeps its key so lookups never touch the quanta
+ * until the value is copied out.
+ */
+#define SCULL_KV_MIN_BITS 6
+
+struct scull_kv_rec {
+    struct hlist_node node;
+    u32 hash;
+    u32 key_len, value_len;
+    loff_t value_pos; /* where the value starts in the device */
+    char key[];
+};
+
+struct scull_kv {
+    unsigned int bits;
+    unsigned long nr; /* live records */
+    struct hlist_head *heads;
+};
+
+static struct scull_kv *scull_kv_alloc(void){
+    struct scull_kv *kv = kzalloc(sizeof(struct scull_kv), GFP_KERNEL);
+    if (!kv)
+        return NULL;
+    kv->bits = SCULL_KV_MIN_BITS;
+    kv->heads = kvcalloc(1UL << kv->bits, sizeof(struct hlist_head), GFP_KERNEL);
+    if (!kv->heads) {
+        kfree(kv);
+        return NULL;
+    }
+    return kv;
+}
+
+static void scull_kv_clear(struct scull_kv *kv){
+    struct scull_kv_rec *rec;
+    struct hlist_node *tmp;
+    unsigned long i;
+    for (i = 0; i < (1UL << kv->bits); i++)
+        hlist_for_each_entry_safe(rec, tmp, &kv->heads[i], node) {
+            hlist_del(&rec->node);
+            kfree(rec);
+        }
+    kv->nr = 0;
+}
+
+static void scull_kv_free(struct scull_kv *kv){
+    scull_kv_clear(kv);
+    kvfree(kv->heads);
+    kfree(kv);
+}
+
+static struct hlist_head *scull_kv_head(struct scull_kv *kv, u32 hash){
+    return &kv->heads[hash & ((1UL << kv->bits) - 1)];
+}
+
+static struct scull_kv_rec *scull_kv_find(struct scull_kv *kv, const char *key, u32 key_len, u32 hash){
+    struct scull_kv_rec *rec;
+    hlist_for_each_entry(rec, scull_kv_head(kv, hash), node)
+        if (rec->hash == hash && rec->key_len == key_len && !memcmp(rec->key, key, key_len))
+            return rec;
+    return NULL;
+}
+
+/* Double the buckets once chains average two records; failure is harmless */
+static void scull_kv_grow(struct scull_kv *kv){
+    struct hlist_head *heads, *old = kv->heads;
+    struct scull_kv_rec *rec;
+    struct hlist_node *tmp;
+    unsigned long i, n = 1UL << kv->bits;
+
+    if (kv->nr < 2 * n)
+        return;
+    heads = kvcalloc(2 * n, sizeof(struct hlist_head), GFP_KERNEL);
+    if (!heads)
+        return;
+    kv->heads = heads;
+    kv->bits++;
+    for (i = 0; i < n; i++)
+        hlist_for_each_entry_safe(rec, tmp, &old[i], node) {
+            hlist_del(&rec->node);
+            hlist_add_head(&rec->node, scull_kv_head(kv, rec->hash));
+        }
+    kvfree(old);
+}
+
+/*
+ * Copy count bytes between the device at pos and either a kernel (kbuf)
+ * or a user (ubuf) buffer, one quantum at a time.
+ */
+static int scull_kv_copy(struct scull_dev *dev, loff_t pos, void *kbuf, void __user *ubuf, size_t count, int write){
+    size_t avail, n;
+    char *p;
+
+    while (count) {
+        p = scull_quantum_at(dev, pos, write, &avail);
+        if (!p)
+            return write ? -ENOMEM : -EIO;
+        n = min(count, avail);
+        if (kbuf) {
+            if (write)
+                memcpy(p, kbuf, n);
+            else
+                memcpy(kbuf, p, n);
+            kbuf = (char *) kbuf + n;
+        } else {
+            if (write ? copy_from_user(p, ubuf, n) : copy_to_user(ubuf, p, n))
+                return -EFAULT;
+            ubuf = (char __user *) ubuf + n;
+        }
+        pos += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* Append one record at the end of the device; value may be NULL for a delete */
+static int scull_kv_append(struct scull_dev *dev, const char *key, u32 key_len,
+                           const void __user *value, u32 value_len, loff_t *value_pos){
+    struct scull_kv_hdr hdr = {key_len, value ? value_len : SCULL_KV_DELETED};
+    loff_t pos = dev->size;
     int err;
-    long retval, tmp;
+
+    err = scull_kv_copy(dev, pos, &hdr, NULL, sizeof(hdr), 1);
+    if (!err)
+        err = scull_kv_copy(dev, pos + sizeof(hdr), (void *) key, NULL, key_len, 1);
+    pos += sizeof(hdr) + key_len;
+    if (!err && value)
+        err = scull_kv_copy(dev, pos, NULL, (void __user *) value, value_len, 1);
+    if (err)
+        return err; /* size not moved: the partial record is overwritten next time */
+    *value_pos = pos;
+    dev->size = (unsigned long) (pos + (value ? value_len : 0));
+    return 0;
+}
+
+static long scull_ioctl_kv(struct scull_dev *dev, unsigned int cmd, struct scull_kv_req __user *ureq){
+    struct scull_kv_req req;
+    struct scull_kv_rec *rec;
+    char key[SCULL_KV_MAX_KEY];
+    loff_t value_pos;
+    long retval = 0;
+    u32 hash;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (!req.key_len || req.key_len > SCULL_KV_MAX_KEY)
+        return -EINVAL;
+    if (cmd == SCULL_IOCKVPUT && req.value_len > SCULL_KV_MAX_VALUE)
+        return -EINVAL;
+    if (copy_from_user(key, u64_to_user_ptr(req.key), req.key_len))
+        return -EFAULT;
+    hash = jhash(key, req.key_len, 0);
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (!dev->kv) {
+        retval = -EINVAL;
+        goto out;
+    }
+    rec = scull_kv_find(dev->kv, key, req.key_len, hash);
+    switch (cmd) {
+        case SCULL_IOCKVGET:
+            if (!rec) {
+                retval = -ENOENT;
+                break;
+            }
+            if (req.value_len < rec->value_len) {
+                /* tell the caller how big the buffer must be */
+                retval = put_user(rec->value_len, &ureq->value_len) ? -EFAULT : -E2BIG;
+                break;
+            }
+            retval = scull_kv_copy(dev, rec->value_pos, NULL, u64_to_user_ptr(req.value), rec->value_len, 0);
+            if (!retval && put_user(rec->value_len, &ureq->value_len))
+                retval = -EFAULT;
+            break;
+        case SCULL_IOCKVPUT:
+            retval = scull_kv_append(dev, key, req.key_len, u64_to_user_ptr(req.value), req.value_len, &value_pos);
+            if (retval)
+                break;
+            if (!rec) {
+                rec = kmalloc(sizeof(*rec) + req.key_len, GFP_KERNEL);
+                if (!rec) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                rec->hash = hash;
+                rec->key_len = req.key_len;
+                memcpy(rec->key, key, req.key_len);
+                hlist_add_head(&rec->node, scull_kv_head(dev->kv, hash));
+                dev->kv->nr++;
+                scull_kv_grow(dev->kv);
+            }
+            /* a replaced value stays in the log, unreferenced */
+            rec->value_len = req.value_len;
+            rec->value_pos = value_pos;
+            break;
+        case SCULL_IOCKVDEL:
+            if (!rec) {
+                retval = -ENOENT;
+                break;
+            }
+            retval = scull_kv_append(dev, key, req.key_len, NULL, 0, &value_pos);
+            if (retval)
+                break;
+            hlist_del(&rec->node);
+            kfree(rec);
+            dev->kv->nr--;
+            break;
+    }
+    out:
+        up(&dev->sem);
+        return retval;
+}
+
+/* Drop the record index of a device that goes away */
+void scull_kv_destroy(struct scull_dev *dev){
+    if (dev->kv)
+        scull_kv_free(dev->kv);
+    dev->kv = NULL;
+}
+
+/* Tell: 1 turns keyed record mode on for an empty device, 0 turns it off */
+static long scull_ioctl_kvmode(struct scull_dev *dev, unsigned long on){
+    long retval = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (on && !dev->kv) {
+        if (dev->size)
+            retval = -EBUSY;
+        else if (!(dev->kv = scull_kv_alloc()))
+            retval = -ENOMEM;
+    } else if (!on) {
+        /* the records stay readable as a plain log */
+        scull_kv_destroy(dev);
+    }
+    up(&dev->sem);
+    return retval;
+}
+
+/**
+ * scull_dirty_ranges - report the byte ranges written this generation
+ * @dev:  a scull_device, semaphore held
+ * @ur:   user array receiving the ranges
+ * @cap:  number of entries @ur can take
+ * @full: report [0, size) instead of the dirty quanta
+ *
+ * Adjacent dirty quanta are merged into one range. Returns the number
+ * of ranges needed, which may be larger than @cap, or -EFAULT.
+ */
+static long scull_dirty_ranges(struct scull_dev *dev, struct scull_range __user *ur, u32 cap, bool full){
+    struct scull_qset *dptr;
+    struct scull_range cur = {0, 0};
+    long qset = dev->qset, quantum = dev->quantum;
+    long item, n = 0;
+    unsigned long s_pos;
+    u64 off;
+
+    if (full && dev->size) {
+        cur.length = dev->size;
+        n = 1;
+    }
+    for (dptr = dev->data, item = 0; !full && dptr; dptr = dptr->next, item++) {
+        if (!dptr->dirty)
+            continue;
+        for_each_set_bit(s_pos, dptr->dirty, qset) {
+            off = (u64) (item * qset + s_pos) * quantum;
+            if (off >= dev->size)
+                break;
+            if (n && cur.offset + cur.length == off) {
+                cur.length += quantum;
+            } else {
+                if (n && n <= cap && copy_to_user(ur + n - 1, &cur, sizeof(cur)))
+                    return -EFAULT;
+                cur.offset = off;
+                cur.length = quantum;
+                n++;
+            }
+            /* the last quantum may be partially used */
+            if (cur.offset + cur.length > dev->size)
+                cur.length = dev->size - cur.offset;
+        }
+    }
+    if (n && n <= cap && copy_to_user(ur + n - 1, &cur, sizeof(cur)))
+        return -EFAULT;
+    return n;
+}
+
+/* Start a new generation: forget which quanta were written */
+static void scull_dirty_reset(struct scull_dev *dev){
+    struct scull_qset *dptr;
+    for (dptr = dev->data; dptr; dptr = dptr->next)
+        if (dptr->dirty)
+            bitmap_zero(dptr->dirty, dev->qset);
+    dev->generation++;
+}
+
+static long scull_ioctl_dirty(struct scull_dev *dev, struct scull_dirty __user *udirty){
+    struct scull_dirty req;
+    long n;
+
+    if (copy_from_user(&req, udirty, sizeof(req)))
+        return -EFAULT;
+    if (req.flags & ~SCULL_DIRTY_PEEK)
+        return -EINVAL;
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    n = scull_dirty_ranges(dev, u64_to_user_ptr(req.ranges), req.nr_ranges,
+                           req.since != dev->generation);
+    if (n < 0)
+        goto out;
+    req.size = dev->size;
+    if (n > req.nr_ranges) {
+        /* tell the caller how big the array must be, and keep the generation */
+        req.generation = dev->generation;
+        req.nr_ranges = (u32) n;
+        n = copy_to_user(udirty, &req, sizeof(req)) ? -EFAULT : -E2BIG;
+        goto out;
+    }
+    req.nr_ranges = (u32) n;
+    if (!(req.flags & SCULL_DIRTY_PEEK))
+        scull_dirty_reset(dev);
+    req.generation = dev->generation;
+    n = copy_to_user(udirty, &req, sizeof(req)) ? -EFAULT : 0;
+    out:
+        up(&dev->sem);
+        return n;
+}
+
+static long scull_ioctl_numa(struct scull_dev *dev, unsigned int cmd, struct scull_numa __user *unuma){
+    struct scull_numa numa;
+
+    if (cmd == SCULL_IOCGNUMA) {
+        numa.policy = dev->numa_policy;
+        numa.node = dev->numa_node;
+        return copy_to_user(unuma, &numa, sizeof(numa)) ? -EFAULT : 0;
+    }
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&numa, unuma, sizeof(numa)))
+        return -EFAULT;
+    if (!scull_numa_valid(numa.policy, numa.node))
+        return -EINVAL;
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    /* quanta already written stay where they are */
+    dev->numa_policy = numa.policy;
+    if (numa.policy == SCULL_NUMA_BIND)
+        dev->numa_node = numa.node;
+    up(&dev->sem);
+    return 0;
+}
+
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    int err = 0;
+    long retval = 0, tmp;
 
     /* validation_1: ensure the type && the command number meets our need*/
     if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC || _IOC_NR(cmd) > SCULL_IOC_MAXNR)
@@ -245,8 +737,11 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
             tmp = scull_qset;
             scull_qset = (int) arg;
             retval = tmp;
-        case SCULL_P_IOCTSIZE:
-            scull_p_buffer = (int) arg;
+            break;
+        case SCULL_P_IOCTSIZE: // Tell: default ring size of the pipes opened from now on
+            retval = scull_p_size_check(arg);
+            if (retval == 0)
+                WRITE_ONCE(scull_p_buffer, (int) arg);
             break;
         case SCULL_P_IOCQSIZE:
             return scull_p_buffer;
@@ -257,6 +752,50 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     return retval;
 };
 
+/*
+ * The per-device commands, for the modules whose private_data is a
+ * struct scull_dev (scull and the access devices); the rest go on to
+ * scull_ioctl().
+ */
+long scull_dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    struct scull_dev *dev;
+    long retval = 0;
+
+    switch(cmd){
+        case SCULL_IOCGDIRTY:
+            retval = scull_ioctl_dirty(filp->private_data, (struct scull_dirty __user *)arg);
+            break;
+        case SCULL_IOCSNUMA:
+        case SCULL_IOCGNUMA:
+            retval = scull_ioctl_numa(filp->private_data, cmd, (struct scull_numa __user *)arg);
+            break;
+        case SCULL_IOCTLARGE: // Tell: arg is the order
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            dev = filp->private_data;
+            if (down_interruptible(&dev->sem))
+                return -ERESTARTSYS;
+            retval = scull_set_large(dev, (int) arg);
+            up(&dev->sem);
+            break;
+        case SCULL_IOCQLARGE: // Query: return it (it's positive)
+            dev = filp->private_data;
+            retval = dev->large_order;
+            break;
+        case SCULL_IOCTKV: // Tell: arg turns keyed record mode on or off
+            retval = scull_ioctl_kvmode(filp->private_data, arg);
+            break;
+        case SCULL_IOCKVPUT:
+        case SCULL_IOCKVGET:
+        case SCULL_IOCKVDEL:
+            retval = scull_ioctl_kv(filp->private_data, cmd, (struct scull_kv_req __user *)arg);
+            break;
+        default:
+            return scull_ioctl(filp, cmd, arg);
+    }
+    return retval;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence){
     /*
      * Same function as $ROOT/scull/scull.c:scull_llseek
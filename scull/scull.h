@@ -24,34 +24,91 @@
 
 #define SCULL_MAJOR 0   /* dynamic major by default */
 #define SCULL_NR_DEVS 4    /* scull0 through scull3 */
+#define SCULL_MAX_DEVS 4096 /* minors that can get a device on demand */
 #define SCULL_QUANTUM 4000
 #define SCULL_QSET    1000
 #define SCULL_P_BUFFER 4000
 
+/*
+ * Where scull_write places new quanta (scull_numa_policy).
+ */
+#define SCULL_NUMA_LOCAL      0 /* on the writer's node */
+#define SCULL_NUMA_INTERLEAVE 1 /* round-robin over the online nodes */
+#define SCULL_NUMA_BIND       2 /* always on numa_node */
 
+/*
+ * Large quanta: PAGE_SIZE << order bytes each, backed by a high-order
+ * folio when one is free and by vmalloc'ed pages otherwise.
+ */
+#define SCULL_LARGE_ORDER     0 /* off by default */
+#define SCULL_LARGE_MAX_ORDER 10
 
 
 
+
+
+#ifdef __KERNEL__
 struct scull_qset {
     void **data;
+    unsigned long *dirty; /* one bit per quantum written this generation */
     struct scull_qset *next;
 };
 
+struct scull_kv;
+
 struct scull_dev {
     int quantum; /* the current quantum size */
     int qset; /* the current array size */
     struct scull_qset *data; /* Pointer to first quantum set */
     unsigned long size; /* amount of data stored here */
     unsigned int access_key; /* used by sculluid and scullpriv */
+    unsigned long generation; /* bumped on trim and on every dirty collection */
+    int numa_policy; /* SCULL_NUMA_* placement of new quanta */
+    int numa_node; /* node used by SCULL_NUMA_BIND */
+    int numa_next; /* last node used by SCULL_NUMA_INTERLEAVE */
+    unsigned long *node_quanta; /* quanta held on each node, may be NULL */
+    int large_order; /* non-zero: quanta are PAGE_SIZE << large_order */
+    unsigned long vmalloc_quanta; /* large quanta that fell back to vmalloc */
+    int nopen; /* open files, a device is only destroyed at zero */
+    struct scull_kv *kv; /* record index, non-NULL in keyed record mode */
     struct semaphore sem; /* mutual exclusion semaphore */
     struct cdev cdev; /* Char device structure */
 };
+struct scull_p_shard;
+struct scull_p_ring;
+struct scull_p_handoff;
+struct scull_p_stats;
+
 struct scull_pipe{
     wait_queue_head_t inq, outq;
     char *buffer, *end;
     int buffersize;
-    char *rp, *wp;
+    int buffer_cfg; /* size set by SCULL_P_IOCTBUF, else scull_p_buffer */
+    char *rp, *wp; /* moved by the owner of each side, see scull_p_lock */
+    unsigned long flags; /* SCULL_P_READING, SCULL_P_WRITING owner bits */
+    seqcount_t resize_seq; /* rp/wp/buffersize being swapped by a resize */
     int nreaders, nwriters;
+    int shard_cfg; /* shards to set up when the buffer is allocated */
+    int nshards; /* 0: the single ring above */
+    struct scull_p_shard *shards;
+    int merge, rr; /* SCULL_P_MERGE_*, next shard for round-robin */
+    int record_cfg, records; /* each write() is one message, see SCULL_P_IOCTRECORD */
+    int stamp_cfg, stamps; /* latency stamps, see SCULL_P_IOCTSTAMP */
+    int mmap_cfg;
+    int rcvlowat, sndlowat; /* wakeup watermarks, see SCULL_P_IOCTRCVLOWAT */
+    int spin_us; /* busy-poll budget, see SCULL_P_IOCTSPIN */
+    unsigned int spin_ns; /* current busy-poll window, tuned by each wait */
+    struct scull_p_ring *ring; /* mapped mode, see SCULL_P_IOCTMMAP */
+    u32 ring_size; /* data bytes behind ring; user space can rewrite ring->size */
+    struct scull_p_handoff *handoff; /* buffer of a reader blocked on an empty ring */
+    int bcast_cfg, bcast; /* SCULL_P_BCAST_* policy, see SCULL_P_IOCTBCAST */
+    u64 bhead, bresv, btail; /* broadcast positions: written, being written, slowest reader */
+    struct list_head subs; /* struct scull_p_sub, one per broadcast reader */
+    spinlock_t sub_lock;
+    int nsubs;
+    int lanes_cfg;
+    struct scull_p_shard *lanes; /* lanes 1 .. SCULL_P_LANES - 1, see SCULL_P_IOCTLANES */
+    struct scull_p_stats __percpu *stats; /* see /proc/scullpipe_stats */
     struct fasync_struct *async_queue;
     struct semaphore sem;
     struct cdev cdev;
@@ -66,12 +123,21 @@ extern int scull_nr_devs;	/* number of bare scull devices */
 extern int scull_quantum;
 extern int scull_qset;
 extern int scull_p_buffer;
+extern int scull_numa_policy;
+extern int scull_numa_node;
+extern int scull_large_order;
 
 int scull_trim(struct scull_dev *dev);
+int scull_numa_valid(int policy, int node);
+long scull_p_size_check(unsigned long size);
 ssize_t scull_read(struct file *, char __user *, size_t, loff_t *);
 ssize_t scull_write(struct file *, const char __user *, size_t, loff_t *);
 long scull_ioctl(struct file *, unsigned int, unsigned long);
+long scull_dev_ioctl(struct file *, unsigned int, unsigned long);
 loff_t scull_llseek(struct file *, loff_t, int);
+int scull_set_large(struct scull_dev *dev, int order);
+void scull_kv_destroy(struct scull_dev *dev);
+#endif /* __KERNEL__ */
 
 
 
@@ -114,6 +180,206 @@ loff_t scull_llseek(struct file *, loff_t, int);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Incremental backups: SCULL_IOCGDIRTY fills "ranges" with the byte
+ * ranges written since generation "since" and starts a new generation
+ * (unless SCULL_DIRTY_PEEK is set). If "since" is not the current
+ * generation the whole device is reported. When more than "nr_ranges"
+ * ranges are needed, -E2BIG is returned with "nr_ranges" set to the
+ * required count and the generation is left alone.
+ */
+struct scull_range {
+    __u64 offset;
+    __u64 length;
+};
+struct scull_dirty {
+    __u64 since;        /* in: generation of the previous backup */
+    __u64 generation;   /* out: generation to pass next time */
+    __u64 size;         /* out: current device size */
+    __u64 ranges;       /* in: user pointer to a struct scull_range array */
+    __u32 nr_ranges;    /* in: array capacity, out: ranges reported */
+    __u32 flags;
+};
+#define SCULL_DIRTY_PEEK 0x1 /* report only, keep the current generation */
+
+#define SCULL_IOCGDIRTY _IOWR(SCULL_IOC_MAGIC, 15, struct scull_dirty)
+
+/* Per-device quantum placement, see SCULL_NUMA_* */
+struct scull_numa {
+    __s32 policy;
+    __s32 node; /* only used by SCULL_NUMA_BIND */
+};
+#define SCULL_IOCSNUMA _IOW(SCULL_IOC_MAGIC, 16, struct scull_numa)
+#define SCULL_IOCGNUMA _IOR(SCULL_IOC_MAGIC, 17, struct scull_numa)
+
+/* Large quanta: Tell the order (0 goes back to scull_quantum), only on an empty device */
+#define SCULL_IOCTLARGE _IO(SCULL_IOC_MAGIC,  18)
+#define SCULL_IOCQLARGE _IO(SCULL_IOC_MAGIC,  19)
+
+/* On-demand devices: Tell the index of the device to create or destroy */
+#define SCULL_IOCTCREATE  _IO(SCULL_IOC_MAGIC,  20)
+#define SCULL_IOCTDESTROY _IO(SCULL_IOC_MAGIC,  21)
+
+/*
+ * Keyed record mode: SCULL_IOCTKV (Tell 1/0) turns an empty device into
+ * a key/value store indexed by an in-kernel hash. Every put or delete
+ * appends a record (struct scull_kv_hdr, key, value) to the device data,
+ * which read() still returns; plain writes fail with EBUSY meanwhile.
+ * Replaced and deleted records keep their space until the next trim.
+ */
+#define SCULL_KV_MAX_KEY   256
+#define SCULL_KV_MAX_VALUE (1 << 20)
+#define SCULL_KV_DELETED   0xffffffffU /* value_len of a delete record */
+
+struct scull_kv_hdr {
+    __u32 key_len;
+    __u32 value_len;
+};
+struct scull_kv_req {
+    __u64 key;          /* user pointer to the key */
+    __u64 value;        /* user pointer to the value */
+    __u32 key_len;
+    __u32 value_len;    /* get: buffer size in, record size out */
+};
+#define SCULL_IOCTKV    _IO(SCULL_IOC_MAGIC,   22)
+#define SCULL_IOCKVPUT  _IOW(SCULL_IOC_MAGIC,  23, struct scull_kv_req)
+#define SCULL_IOCKVGET  _IOWR(SCULL_IOC_MAGIC, 24, struct scull_kv_req)
+#define SCULL_IOCKVDEL  _IOW(SCULL_IOC_MAGIC,  25, struct scull_kv_req)
+
+/*
+ * Sharded scullpipe: one sub-ring per writer CPU. SCULL_P_IOCTSHARDS
+ * tells the number of shards (0 for the single ring) used from the next
+ * open of an idle pipe, like the buffer size. SCULL_P_IOCTMERGE picks
+ * how the reader merges them.
+ */
+#define SCULL_P_SHARDS_PER_CPU (-1)
+#define SCULL_P_MAX_SHARDS     256
+#define SCULL_P_MERGE_RR       0 /* one segment from each shard in turn */
+#define SCULL_P_MERGE_STAMP    1 /* oldest write first */
+#define SCULL_P_IOCTSHARDS _IO(SCULL_IOC_MAGIC, 26)
+#define SCULL_P_IOCTMERGE  _IO(SCULL_IOC_MAGIC, 27)
+
+/*
+ * Record mode, from the next open of an idle pipe like the buffer
+ * size: each write() is kept as one message and each read()
+ * returns exactly one (-EMSGSIZE if it doesn't fit, leaving it queued).
+ * SCULL_P_IOCRECV takes as many whole messages as fit into buf in one
+ * call, packed back to back, with their lengths in lens[]; count and
+ * bytes come back filled in. It blocks like read() for the first one.
+ */
+struct scull_p_msgs {
+    __u64 buf;   /* char * */
+    __u32 size;  /* of buf */
+    __u32 max;   /* entries in lens */
+    __u64 lens;  /* __u32 *, may be 0 */
+    __u32 count; /* out: messages */
+    __u32 bytes; /* out: bytes in buf */
+};
+#define SCULL_P_IOCTRECORD _IO(SCULL_IOC_MAGIC, 28)
+#define SCULL_P_IOCRECV    _IOWR(SCULL_IOC_MAGIC, 29, struct scull_p_msgs)
+
+/*
+ * Per-pipe ring size, like F_SETPIPE_SZ: SCULL_P_IOCTBUF resizes an
+ * open pipe keeping the data in flight (-EBUSY if it wouldn't fit) and
+ * returns the new size. Sizes above SCULL_P_MAX_USER_BUFFER need
+ * CAP_SYS_RESOURCE. SCULL_P_IOCTSIZE still sets the default, within the
+ * same limits.
+ */
+#define SCULL_P_MIN_BUFFER      64
+#define SCULL_P_MAX_USER_BUFFER (1 << 20)
+#define SCULL_P_MAX_BUFFER      (64 << 20)
+#define SCULL_P_IOCTBUF    _IO(SCULL_IOC_MAGIC, 30)
+#define SCULL_P_IOCQBUF    _IO(SCULL_IOC_MAGIC, 31)
+
+/*
+ * Mapped ring, from the next open of an idle pipe: mmap() the control
+ * page and the data behind it (data_offset + size bytes at offset 0)
+ * and move data without system calls, perf style. head and tail run
+ * free; the bytes of index i are at data[i & (size - 1)]. The producer
+ * stores data then head (release), the consumer reads head (acquire),
+ * the data, then stores tail (release). read() and write() return
+ * -EINVAL; poll() reports head/tail and SCULL_P_IOCRING wakes the
+ * other side. A side that sleeps sets its SCULL_P_RING_*WAIT bit then
+ * checks again before polling; the other side rings only if the bit
+ * is set, after a full barrier between its index store and the check.
+ */
+struct scull_p_ring {
+    __u32 head;        /* written by the producer */
+    __u32 tail;        /* written by the consumer */
+    __u32 size;        /* data bytes, a power of two */
+    __u32 data_offset; /* of the data in the mapping */
+    __u32 flags;       /* SCULL_P_RING_RWAIT, SCULL_P_RING_WWAIT */
+};
+#define SCULL_P_RING_RWAIT       1 /* consumer sleeps in poll */
+#define SCULL_P_RING_WWAIT       2 /* producer sleeps in poll */
+#define SCULL_P_RING_WAKE_READER 1
+#define SCULL_P_RING_WAKE_WRITER 2
+#define SCULL_P_IOCRING    _IO(SCULL_IOC_MAGIC, 32)
+#define SCULL_P_IOCTMMAP   _IO(SCULL_IOC_MAGIC, 33)
+
+/*
+ * Wakeup watermarks of the ring, like SO_RCVLOWAT/SO_SNDLOWAT (default
+ * 1): blocked readers and POLLIN wait for RCVLOWAT queued bytes,
+ * blocked writers and POLLOUT for SNDLOWAT free bytes. Non-blocking
+ * reads still return whatever is queued. In record mode readers wake
+ * for any whole message, RCVLOWAT is ignored.
+ */
+#define SCULL_P_IOCTRCVLOWAT _IO(SCULL_IOC_MAGIC, 34)
+#define SCULL_P_IOCTSNDLOWAT _IO(SCULL_IOC_MAGIC, 35)
+
+/*
+ * Broadcast mode, from the next open of an idle pipe: every reader
+ * gets every byte written after its open, through its own cursor. The
+ * policy says what a writer does when the slowest reader is a ring
+ * behind: wait for it (BLOCK), or overwrite (DROP), in which case that
+ * reader's next read() fails with EOVERFLOW and SCULL_P_IOCQOVERRUN
+ * returns (and clears) the bytes it lost. The policy of a broadcast
+ * pipe can be changed while it is in use.
+ */
+#define SCULL_P_BCAST_BLOCK 1
+#define SCULL_P_BCAST_DROP  2
+#define SCULL_P_IOCTBCAST   _IO(SCULL_IOC_MAGIC, 36)
+#define SCULL_P_IOCQOVERRUN _IO(SCULL_IOC_MAGIC, 37)
+
+/*
+ * Priority lanes, from the next open of an idle pipe: lane 0 is the
+ * ring, lanes 1 .. SCULL_P_LANES - 1 are small rings of whole messages
+ * (up to SCULL_P_LANE_BUFFER bytes with their header). A read() takes
+ * the next message of the highest lane holding one before any lane 0
+ * data, and fails with EMSGSIZE if it doesn't fit. SCULL_P_IOCTLANE
+ * picks the lane of a file's write()s; SCULL_P_IOCWLANE does one write
+ * on any lane.
+ */
+#define SCULL_P_LANES       4
+#define SCULL_P_LANE_BUFFER 4096 /* a power of two */
+struct scull_p_lane_msg {
+    __u64 buf;  /* const char * */
+    __u32 len;
+    __u32 lane;
+};
+#define SCULL_P_IOCTLANES _IO(SCULL_IOC_MAGIC, 38)
+#define SCULL_P_IOCTLANE  _IO(SCULL_IOC_MAGIC, 39)
+#define SCULL_P_IOCWLANE  _IOW(SCULL_IOC_MAGIC, 40, struct scull_p_lane_msg)
+
+/*
+ * Adaptive spinning, like busy_poll on sockets: a reader of an empty
+ * ring or a writer of a full one busy-polls it before going to sleep.
+ * The window grows while waits end within the budget (microseconds,
+ * up to SCULL_P_MAX_SPIN) and shrinks when they don't. 0 turns it off.
+ */
+#define SCULL_P_MAX_SPIN   1000
+#define SCULL_P_IOCTSPIN   _IO(SCULL_IOC_MAGIC, 41)
+
+/*
+ * Latency stamps, from the next open of an idle pipe in record or
+ * sharded mode: each message (segment) keeps the time it was written,
+ * and the delay until it is read goes into the latency histogram of
+ * /proc/scullpipe_stats. SCULL_P_IOCGLAT gets the delay in ns of the
+ * last one this file finished reading. The payload is unchanged.
+ */
+#define SCULL_P_IOCTSTAMP  _IO(SCULL_IOC_MAGIC, 42)
+#define SCULL_P_IOCGLAT    _IOR(SCULL_IOC_MAGIC, 43, __u64)
 /* ... more to come */
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 43
 #endif //SCULL_H
@@ -4,6 +4,11 @@
 #include <linux/semaphore.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/nodemask.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
 #include "../scull.h"
 
 MODULE_LICENSE("GPL");
@@ -22,31 +27,161 @@ module_param(scull_minor,int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
-struct scull_dev *scull_devices;	/* allocated in scull_init_module */
+module_param(scull_numa_policy, int, S_IRUGO);
+module_param(scull_numa_node, int, S_IRUGO);
+module_param(scull_large_order, int, S_IRUGO);
+static int scull_max_devs = SCULL_MAX_DEVS;	/* minors reserved for scull */
+module_param(scull_max_devs, int, S_IRUGO);
 
+/*
+ * Devices are created on demand: one cdev covers all scull_max_devs
+ * minors and scull_table maps a minor to its device, NULL until the
+ * minor is first opened or created with SCULL_IOCTCREATE.
+ */
+static struct scull_dev **scull_table;
+static DEFINE_MUTEX(scull_table_lock);
+static struct cdev scull_cdev;
+static struct proc_dir_entry *scull_proc;
 
+static struct scull_dev *scull_create(void){
+    struct scull_dev *dev = kzalloc(sizeof(struct scull_dev), GFP_KERNEL);
+    if (!dev)
+        return NULL;
+    dev->quantum = scull_quantum;
+    dev->qset = scull_qset;
+    dev->numa_policy = scull_numa_policy;
+    dev->numa_node = scull_numa_node;
+    dev->numa_next = first_online_node;
+    scull_set_large(dev, scull_large_order); /* checked at load time */
+    // per-node accounting is optional, scull_alloc_quantum skips it on NULL
+    dev->node_quanta = kcalloc(nr_node_ids, sizeof(unsigned long), GFP_KERNEL);
+    sema_init(&dev->sem, 1);
+    return dev;
+}
+
+static void scull_destroy(struct scull_dev *dev){
+    scull_trim(dev);
+    scull_kv_destroy(dev);
+    kfree(dev->node_quanta);
+    kfree(dev);
+}
+
+/* Find the device behind index i, creating it if needed; table lock held */
+static struct scull_dev *scull_lookup(int i){
+    if (i < 0 || i >= scull_max_devs)
+        return NULL;
+    if (!scull_table[i])
+        scull_table[i] = scull_create();
+    return scull_table[i];
+}
 
 
 static int scull_open(struct inode *inode, struct file *filp) {
     struct scull_dev *dev;
-    dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    mutex_lock(&scull_table_lock);
+    dev = scull_lookup(iminor(inode) - scull_minor);
+    if (dev)
+        dev->nopen++;
+    mutex_unlock(&scull_table_lock);
+    if (!dev)
+        return -ENOMEM;
     filp->private_data = dev;
     // Trim to 0 the length of the device if open was write only
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (down_interruptible(&dev->sem))
+        if (down_interruptible(&dev->sem)) {
+            mutex_lock(&scull_table_lock);
+            dev->nopen--;
+            mutex_unlock(&scull_table_lock);
             return -ERESTARTSYS;
+        }
         scull_trim(dev);
         up(&dev->sem);
     }
     return 0;
 }
 
+static int scull_release(struct inode *inode, struct file *filp) {
+    struct scull_dev *dev = filp->private_data;
+    mutex_lock(&scull_table_lock);
+    dev->nopen--;
+    mutex_unlock(&scull_table_lock);
+    return 0;
+}
+
+static long scull_table_ioctl(unsigned int cmd, int i){
+    long retval = 0;
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (i < 0 || i >= scull_max_devs)
+        return -EINVAL;
+    mutex_lock(&scull_table_lock);
+    if (cmd == SCULL_IOCTCREATE) {
+        if (!scull_lookup(i))
+            retval = -ENOMEM;
+    } else if (scull_table[i]) {
+        /* the data goes away with the device, so only when nobody uses it */
+        if (scull_table[i]->nopen) {
+            retval = -EBUSY;
+        } else {
+            scull_destroy(scull_table[i]);
+            scull_table[i] = NULL;
+        }
+    }
+    mutex_unlock(&scull_table_lock);
+    return retval;
+}
+
+static long scull_main_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    switch (cmd) {
+        case SCULL_IOCTCREATE: // Tell: arg is the device index
+        case SCULL_IOCTDESTROY:
+            return scull_table_ioctl(cmd, (int) arg);
+        default:
+            return scull_dev_ioctl(filp, cmd, arg);
+    }
+}
+
+/*
+ * /proc/scullstats: one block per existing device with its per-node quanta
+ */
+static const char *scull_numa_names[] = {"local", "interleave", "bind"};
+
+static int scull_stats_show(struct seq_file *s, void *v){
+    int i, nid;
+    mutex_lock(&scull_table_lock);
+    for (i = 0; i < scull_max_devs; i++) {
+        struct scull_dev *dev = scull_table[i];
+        if (!dev)
+            continue;
+        if (down_interruptible(&dev->sem)) {
+            mutex_unlock(&scull_table_lock);
+            return -ERESTARTSYS;
+        }
+        seq_printf(s, "scull%i: size %lu quantum %i qset %i gen %lu numa %s",
+                   i, dev->size, dev->quantum, dev->qset, dev->generation,
+                   scull_numa_names[dev->numa_policy]);
+        if (dev->large_order)
+            seq_printf(s, " large order %i (%lu vmalloc fallbacks)",
+                       dev->large_order, dev->vmalloc_quanta);
+        if (dev->numa_policy == SCULL_NUMA_BIND)
+            seq_printf(s, " node %i", dev->numa_node);
+        seq_putc(s, '\n');
+        for_each_online_node(nid)
+            if (dev->node_quanta)
+                seq_printf(s, "  node%i: %lu quanta\n", nid, dev->node_quanta[nid]);
+        up(&dev->sem);
+    }
+    mutex_unlock(&scull_table_lock);
+    return 0;
+}
+
 struct file_operations scull_fops = {
         .owner=THIS_MODULE,
         .open=scull_open,
+        .release=scull_release,
         .read=scull_read,
         .write=scull_write,
-        .unlocked_ioctl=scull_ioctl,
+        .unlocked_ioctl=scull_main_ioctl,
         .llseek=scull_llseek,
 
 };
@@ -55,12 +190,15 @@ struct file_operations scull_fops = {
 static void scull_exit(void){
 
     int i;
-    for (i=0; scull_devices && i < scull_nr_devs; i++){
-        scull_trim(scull_devices+i) ;
-        cdev_del(&scull_devices[i].cdev);
+    proc_remove(scull_proc);
+    if (scull_table)
+        cdev_del(&scull_cdev);
+    for (i=0; scull_table && i < scull_max_devs; i++){
+        if (scull_table[i])
+            scull_destroy(scull_table[i]);
     }
-    kfree(scull_devices);
-    unregister_chrdev((unsigned int) scull_major, "scull");
+    kvfree(scull_table);
+    unregister_chrdev_region((dev_t) MKDEV(scull_major, scull_minor), scull_max_devs);
 
 }
 
@@ -68,47 +206,63 @@ static void scull_exit(void){
 static int __init scull_init(void){
     int result, i;
     dev_t dev = 0;
+    if (scull_max_devs < scull_nr_devs)
+        scull_max_devs = scull_nr_devs;
     // register the char device
     if (scull_major) {
         // Static - method
         dev = (dev_t) MKDEV(scull_major, scull_minor);
-        result = register_chrdev_region(dev, scull_nr_devs, "scull");
+        result = register_chrdev_region(dev, scull_max_devs, "scull");
     }else{
-        result = alloc_chrdev_region(&dev, scull_minor, scull_nr_devs, "scull");
+        result = alloc_chrdev_region(&dev, scull_minor, scull_max_devs, "scull");
         scull_major = MAJOR(dev);
     }
     if (result < 0){
         printk(KERN_WARNING "scull: cant get major %d.\n", scull_major);
         return result;
     }
+    if (!scull_numa_valid(scull_numa_policy, scull_numa_node)){
+        printk(KERN_WARNING "scull: bad numa policy %d/node %d, using local.\n",
+               scull_numa_policy, scull_numa_node);
+        scull_numa_policy = SCULL_NUMA_LOCAL;
+    }
+    if (scull_large_order < 0 || scull_large_order > SCULL_LARGE_MAX_ORDER){
+        printk(KERN_WARNING "scull: bad scull_large_order %d\n", scull_large_order);
+        scull_large_order = 0;
+    }
 
-    // allocate the devices
-    scull_devices = (struct scull_dev *) kmalloc(scull_nr_devs * sizeof(struct scull_dev), GFP_KERNEL);
-    if (!scull_devices){
+    // only the minor-to-device table is paid for up front
+    scull_table = kvcalloc(scull_max_devs, sizeof(struct scull_dev *), GFP_KERNEL);
+    if (!scull_table){
         result = -ENOMEM;
         goto fail;
     }
-    memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
-    //Init for each device
+    // the first scull_nr_devs devices exist from the start, as before
     for (i=0; i < scull_nr_devs; i++){
-        struct scull_dev *s_dev = scull_devices + i;
-        s_dev->quantum = scull_quantum;
-        s_dev->qset = scull_qset;
-        sema_init(&s_dev->sem, 1);
-        // init char driver
-        cdev_init(&s_dev->cdev, &scull_fops);
-        dev = (dev_t) MKDEV(scull_major, scull_minor + i);
-        s_dev->cdev.owner = THIS_MODULE;
-        s_dev->cdev.ops = &scull_fops;
-        if (cdev_add (&s_dev->cdev, dev, 1)){
-            printk(KERN_NOTICE "Error adding scull %d", i);
+        scull_table[i] = scull_create();
+        if (!scull_table[i]){
+            result = -ENOMEM;
+            goto fail;
         }
-
     }
+    // one char device for the whole minor range
+    cdev_init(&scull_cdev, &scull_fops);
+    scull_cdev.owner = THIS_MODULE;
+    result = cdev_add(&scull_cdev, dev, scull_max_devs);
+    if (result){
+        printk(KERN_NOTICE "Error %d adding scull", result);
+        goto fail;
+    }
+    scull_proc = proc_create_single("scullstats", 0, NULL, scull_stats_show);
     return 0;
 
-    fail:
-        scull_exit();
+    fail: // the cdev is not added yet
+        for (i=0; scull_table && i < scull_nr_devs; i++)
+            if (scull_table[i])
+                scull_destroy(scull_table[i]);
+        kvfree(scull_table);
+        scull_table = NULL;
+        unregister_chrdev_region(dev, scull_max_devs);
         return result;
 }
 
@@ -116,4 +270,3 @@ static int __init scull_init(void){
 
 module_init(scull_init);
 module_exit(scull_exit);
-